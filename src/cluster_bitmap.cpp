@@ -0,0 +1,195 @@
+#include "cluster_bitmap.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+
+static inline uint32_t bit_ctz(uint64_t word)
+{
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return (uint32_t)index;
+}
+
+static inline uint32_t bit_clz(uint64_t word)
+{
+    unsigned long index;
+    _BitScanReverse64(&index, word);
+    return 63 - (uint32_t)index;
+}
+
+static inline uint32_t bit_popcount(uint64_t word)
+{
+    return (uint32_t)__popcnt64(word);
+}
+#else
+static inline uint32_t bit_ctz(uint64_t word)
+{
+    return (uint32_t)__builtin_ctzll(word);
+}
+
+static inline uint32_t bit_clz(uint64_t word)
+{
+    return (uint32_t)__builtin_clzll(word);
+}
+
+static inline uint32_t bit_popcount(uint64_t word)
+{
+    return (uint32_t)__builtin_popcountll(word);
+}
+#endif
+
+cluster_bitmap::cluster_bitmap()
+{
+    words = nullptr;
+    word_counts = nullptr;
+    word_count = 0;
+    bit_count = 0;
+}
+
+cluster_bitmap::~cluster_bitmap()
+{
+    delete[] words;
+    delete[] word_counts;
+}
+
+void cluster_bitmap::resize(uint32_t bits)
+{
+    uint32_t i;
+
+    delete[] words;
+    delete[] word_counts;
+
+    bit_count = bits;
+    word_count = (bits + 63) / 64;
+
+    words = new std::atomic<uint64_t>[word_count];
+    word_counts = new std::atomic<int32_t>[word_count + 1];
+
+    for (i = 0; i < word_count; i++)
+        words[i] = 0;
+    for (i = 0; i <= word_count; i++)
+        word_counts[i] = 0;
+}
+
+void cluster_bitmap::_add_word_count(uint32_t word, int32_t value)
+{
+    uint32_t i;
+
+    for (i = word + 1; i <= word_count; i += (i & (~i + 1)))
+        word_counts[i] += value;
+}
+
+void cluster_bitmap::set(uint32_t index)
+{
+    uint64_t mask = (uint64_t)1 << (index % 64);
+
+    // count only when the bit really changed, so concurrent setters does not count twice
+    if (!(words[index / 64].fetch_or(mask) & mask))
+        _add_word_count(index / 64, 1);
+}
+
+void cluster_bitmap::clear(uint32_t index)
+{
+    uint64_t mask = (uint64_t)1 << (index % 64);
+
+    if (words[index / 64].fetch_and(~mask) & mask)
+        _add_word_count(index / 64, -1);
+}
+
+bool cluster_bitmap::test(uint32_t index)
+{
+    return (words[index / 64] >> (index % 64)) & 1;
+}
+
+uint32_t cluster_bitmap::count()
+{
+    uint32_t i;
+    int32_t total = 0;
+
+    for (i = word_count; i > 0; i -= (i & (~i + 1)))
+        total += word_counts[i];
+
+    return (uint32_t)total;
+}
+
+uint32_t cluster_bitmap::find_first(uint32_t from)
+{
+    uint32_t i;
+    uint64_t word;
+
+    if (from >= bit_count)
+        return BITMAP_NOT_FOUND;
+
+    // mask out bits before starting index in the first word
+    i = from / 64;
+    word = words[i] & (~(uint64_t)0 << (from % 64));
+
+    while (true)
+    {
+        if (word)
+        {
+            from = i * 64 + bit_ctz(word);
+            return (from < bit_count) ? from : BITMAP_NOT_FOUND;
+        }
+
+        if (++i >= word_count)
+            return BITMAP_NOT_FOUND;
+        word = words[i];
+    }
+}
+
+uint32_t cluster_bitmap::find_last(uint32_t before)
+{
+    uint32_t i;
+    uint64_t word;
+
+    if (before > bit_count)
+        before = bit_count;
+    if (before == 0)
+        return BITMAP_NOT_FOUND;
+
+    // mask out bits at and after ending index in the last word
+    i = (before - 1) / 64;
+    word = words[i];
+    if (before % 64)
+        word &= ((uint64_t)1 << (before % 64)) - 1;
+
+    while (true)
+    {
+        if (word)
+            return i * 64 + 63 - bit_clz(word);
+
+        if (i-- == 0)
+            return BITMAP_NOT_FOUND;
+        word = words[i];
+    }
+}
+
+uint32_t cluster_bitmap::select(uint32_t n)
+{
+    uint32_t pos = 0, step, bit;
+    int32_t remaining = (int32_t)n;
+    uint64_t word;
+
+    if (n >= count())
+        return BITMAP_NOT_FOUND;
+
+    // descend Fenwick tree to find word containing n-th set bit
+    for (step = 1; step * 2 <= word_count; step *= 2)
+        ;
+    for (; step > 0; step /= 2)
+    {
+        if (pos + step <= word_count && word_counts[pos + step] <= remaining)
+        {
+            pos += step;
+            remaining -= word_counts[pos];
+        }
+    }
+
+    // and then find the bit in that word
+    word = words[pos];
+    for (bit = 0; bit < (uint32_t)remaining; bit++)
+        word &= word - 1;
+
+    return pos * 64 + bit_ctz(word);
+}
@@ -0,0 +1,50 @@
+#ifndef ZOS_CLUSTER_BITMAP_H
+#define ZOS_CLUSTER_BITMAP_H
+
+#include <stdint.h>
+#include <atomic>
+
+// returned when no matching bit was found
+#define BITMAP_NOT_FOUND 0xFFFFFFFF
+
+// bitmap of clusters with rank/select support; set and clear may be called from more threads at once
+class cluster_bitmap
+{
+    private:
+        // bitmap words
+        std::atomic<uint64_t>* words;
+        // Fenwick tree of word popcounts (1-based), so counting and selecting is logarithmic
+        std::atomic<int32_t>* word_counts;
+        // number of words
+        uint32_t word_count;
+        // number of bits
+        uint32_t bit_count;
+
+        // adds value to count of word
+        void _add_word_count(uint32_t word, int32_t value);
+
+    public:
+        cluster_bitmap();
+        ~cluster_bitmap();
+
+        // allocates bitmap for supplied bit count, all bits are cleared
+        void resize(uint32_t bits);
+
+        // sets bit
+        void set(uint32_t index);
+        // clears bit
+        void clear(uint32_t index);
+        // is bit set?
+        bool test(uint32_t index);
+
+        // number of set bits
+        uint32_t count();
+        // finds first set bit at or after supplied index
+        uint32_t find_first(uint32_t from = 0);
+        // finds last set bit before supplied index
+        uint32_t find_last(uint32_t before);
+        // finds n-th set bit (counted from 0)
+        uint32_t select(uint32_t n);
+};
+
+#endif
@@ -0,0 +1,217 @@
+#include "fileio.h"
+
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <mutex>
+
+// there's no positioned I/O in CRT, so seek and transfer has to be atomic
+static std::mutex fileio_mtx;
+
+int file_open_rw(const char* filename)
+{
+    return _open(filename, _O_RDWR | _O_BINARY);
+}
+
+int file_open_ro(const char* filename)
+{
+    return _open(filename, _O_RDONLY | _O_BINARY);
+}
+
+int file_create_rw(const char* filename)
+{
+    return _open(filename, _O_RDWR | _O_BINARY | _O_CREAT | _O_TRUNC, _S_IREAD | _S_IWRITE);
+}
+
+void file_close(int fd)
+{
+    _close(fd);
+}
+
+bool file_pread(int fd, void* buffer, size_t len, int64_t offset)
+{
+    std::unique_lock<std::mutex> lock(fileio_mtx);
+
+    if (_lseeki64(fd, offset, SEEK_SET) != offset)
+        return false;
+
+    return _read(fd, buffer, (unsigned int)len) == (int)len;
+}
+
+bool file_pwrite(int fd, const void* buffer, size_t len, int64_t offset)
+{
+    std::unique_lock<std::mutex> lock(fileio_mtx);
+
+    if (_lseeki64(fd, offset, SEEK_SET) != offset)
+        return false;
+
+    return _write(fd, buffer, (unsigned int)len) == (int)len;
+}
+
+int64_t file_size(int fd)
+{
+    return _filelengthi64(fd);
+}
+
+bool file_flush(int fd)
+{
+    return _commit(fd) == 0;
+}
+
+bool file_replace(const char* from, const char* to)
+{
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
+int64_t file_stream_size(FILE* f)
+{
+    // long is 32-bit here, so ftell can't be used for images over 2 GB
+    return file_size(_fileno(f));
+}
+
+bool file_stream_seek(FILE* f, int64_t offset)
+{
+    return _fseeki64(f, offset, SEEK_SET) == 0;
+}
+
+uint8_t* file_map(const char* filename, size_t* size)
+{
+    // not supported, caller falls back to regular reading
+    return nullptr;
+}
+
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int file_open_rw(const char* filename)
+{
+    return open(filename, O_RDWR);
+}
+
+int file_open_ro(const char* filename)
+{
+    return open(filename, O_RDONLY);
+}
+
+int file_create_rw(const char* filename)
+{
+    return open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+}
+
+void file_close(int fd)
+{
+    close(fd);
+}
+
+bool file_pread(int fd, void* buffer, size_t len, int64_t offset)
+{
+    ssize_t res;
+    uint8_t* ptr = (uint8_t*)buffer;
+
+    // positioned read may return less than requested, so continue until everything is read
+    while (len > 0)
+    {
+        res = pread(fd, ptr, len, (off_t)offset);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return false;
+
+        ptr += res;
+        len -= res;
+        offset += res;
+    }
+
+    return true;
+}
+
+bool file_pwrite(int fd, const void* buffer, size_t len, int64_t offset)
+{
+    ssize_t res;
+    const uint8_t* ptr = (const uint8_t*)buffer;
+
+    while (len > 0)
+    {
+        res = pwrite(fd, ptr, len, (off_t)offset);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return false;
+
+        ptr += res;
+        len -= res;
+        offset += res;
+    }
+
+    return true;
+}
+
+int64_t file_size(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) != 0)
+        return -1;
+
+    return (int64_t)st.st_size;
+}
+
+bool file_flush(int fd)
+{
+    return fsync(fd) == 0;
+}
+
+bool file_replace(const char* from, const char* to)
+{
+    // rename replaces existing file atomically
+    return rename(from, to) == 0;
+}
+
+int64_t file_stream_size(FILE* f)
+{
+    return file_size(fileno(f));
+}
+
+bool file_stream_seek(FILE* f, int64_t offset)
+{
+    return fseeko(f, (off_t)offset, SEEK_SET) == 0;
+}
+
+uint8_t* file_map(const char* filename, size_t* size)
+{
+    struct stat st;
+    void* ptr;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    // private mapping is writable too, pages are copied on first write
+    ptr = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+    // mapping stays valid after descriptor is closed
+    close(fd);
+
+    if (ptr == MAP_FAILED)
+        return nullptr;
+
+    *size = (size_t)st.st_size;
+
+    return (uint8_t*)ptr;
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef ZOS_FILEIO_H
+#define ZOS_FILEIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// opens existing file for positioned reads and writes; returns -1 on failure
+int file_open_rw(const char* filename);
+// opens existing file for positioned reads only; returns -1 on failure
+int file_open_ro(const char* filename);
+// creates (or truncates) file for positioned reads and writes; returns -1 on failure
+int file_create_rw(const char* filename);
+// closes file opened by file_open_rw
+void file_close(int fd);
+// reads exactly len bytes at offset; returns false on error or end of file
+bool file_pread(int fd, void* buffer, size_t len, int64_t offset);
+// writes exactly len bytes at offset
+bool file_pwrite(int fd, const void* buffer, size_t len, int64_t offset);
+// size of opened file; returns -1 on failure
+int64_t file_size(int fd);
+// waits until all written data are on disk
+bool file_flush(int fd);
+// atomically replaces file "to" by file "from"
+bool file_replace(const char* from, const char* to);
+
+// size of file opened as stream, with 64-bit offsets on all platforms; returns -1 on failure
+int64_t file_stream_size(FILE* f);
+// moves stream to 64-bit offset from file beginning
+bool file_stream_seek(FILE* f, int64_t offset);
+
+// maps whole file into memory privately, changes are kept in memory and never written back to file
+// returns nullptr when file cannot be mapped (or mapping is not supported)
+uint8_t* file_map(const char* filename, size_t* size);
+
+#endif
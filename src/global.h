@@ -21,11 +21,38 @@ using namespace std;
 #define PROGRAM_MODE_DEFRAG 1
 // program mode - creating new image
 #define PROGRAM_MODE_CREATE 2
+// program mode - planning defragmentation without moving anything
+#define PROGRAM_MODE_PLAN 3
+
+// defragmentation engine - queue of clusters ready to be moved, driven by dependencies between moves
+#define DEFRAG_ENGINE_QUEUE 0
+// defragmentation engine - rotation of permutation cycles
+#define DEFRAG_ENGINE_CYCLES 1
+
+// file placement - pack files from partition beginning in root directory order
+#define PLACEMENT_POLICY_PACKED 0
+// file placement - keep contiguous files in place, fill gaps with the rest
+#define PLACEMENT_POLICY_MINIMAL 1
+
+// statistics output - nothing
+#define STATS_OUTPUT_NONE 0
+// statistics output - human readable summary
+#define STATS_OUTPUT_TEXT 1
+// statistics output - JSON, one object per line
+#define STATS_OUTPUT_JSON 2
 
 extern int verbose_output;
 extern bool matching_badblocks;
 extern bool force_not_consistent;
+extern bool release_lost_clusters;
 extern uint8_t thread_count;
 extern int program_mode;
+extern int defrag_engine;
+extern int placement_policy;
+extern uint32_t defrag_move_budget;
+extern uint32_t defrag_time_budget;
+extern bool in_place;
+extern bool mapped_image;
+extern int stats_output;
 
 #endif
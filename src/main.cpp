@@ -1,5 +1,6 @@
 #include "global.h"
 #include "pseudofat.h"
+#include "profiler.h"
 
 #define DEFAULT_INPUT_FILE "output.fat"
 #define DEFAULT_OUTPUT_FILE "output.out.fat"
@@ -7,28 +8,33 @@
 int verbose_output = 0;
 bool matching_badblocks = false;
 bool force_not_consistent = false;
+bool release_lost_clusters = false;
 uint8_t thread_count = 1;
 bool writeout_only = false;
 bool dump_result = false;
 int program_mode = 0;
+int defrag_engine = DEFRAG_ENGINE_QUEUE;
+int placement_policy = PLACEMENT_POLICY_PACKED;
+uint32_t defrag_move_budget = 0;
+uint32_t defrag_time_budget = 0;
+bool in_place = false;
+bool mapped_image = false;
+int stats_output = STATS_OUTPUT_NONE;
+bool hw_counters = false;
 
 int read_mode(const char* filename)
 {
-    // create partition record
-    fat_partition* partition = fat_partition::load_from_file(filename);
+    // create partition record, checks never look at cluster contents, so only metadata are read
+    fat_partition* partition = fat_partition::load_from_file(filename, mapped_image ? CLUSTER_MODE_MAPPED : CLUSTER_MODE_NONE);
     if (!partition)
         return 1;
 
     cout << "Filesystem successfully loaded, proceeding with checks" << endl << endl;
 
-    // check for errors
-    if (!partition->check_fattables())
+    // check for errors, data for future use are cached by the same pass
+    if (!partition->check_and_cache())
         return 2;
 
-    // cache counts
-    cout << "Caching data for future use..." << endl;
-    partition->cache_counts();
-
     cout << "Filesystem is OK" << endl << endl;
 
     // and eventually print contents
@@ -40,32 +46,53 @@ int read_mode(const char* filename)
 
 int defrag_mode(const char* filename, const char* outfilename)
 {
+    int cluster_mode = in_place ? CLUSTER_MODE_DISK : CLUSTER_MODE_MEMORY;
+
+    // in-place mode keeps cluster contents in image file, and saves back to it
+    if (in_place)
+        outfilename = filename;
+
+    // mapping is private, so image saved to the same file is changed only through journal when saving
+    if (mapped_image)
+        cluster_mode = CLUSTER_MODE_MAPPED;
+
     // create partition record
-    fat_partition* partition = fat_partition::load_from_file(filename);
+    fat_partition* partition = fat_partition::load_from_file(filename, cluster_mode);
     if (!partition)
         return 1;
 
     cout << "Filesystem successfully loaded, proceeding with checks" << endl << endl;
 
-    // check for errors before defragmentation
-    if (!partition->check_fattables())
+    // check for errors before defragmentation, data for future use are cached by the same pass
+    if (!partition->check_and_cache())
         return 2;
 
-    // proceed caching
-    cout << "Caching data for future use..." << endl;
-    partition->cache_counts();
-
     cout << "All OK, ready to proceed with defragmentation" << endl << endl;
 
+    std::string inchk = std::string(filename) + DEFRAG_CHECKPOINT_SUFFIX;
+    std::string outchk = std::string(outfilename) + DEFRAG_CHECKPOINT_SUFFIX;
+
     // if only writeout, do nothing
     // well, this is just old code, with writeout mode, we practically get read mode
     if (!writeout_only)
     {
+        // continue where previous budgeted run stopped
+        partition->load_checkpoint(inchk.c_str());
+
         if (!partition->defragment())
             return 3;
 
         if (!partition->save_to_file(outfilename))
             return 4;
+
+        // checkpoint is written only after the image, so it never refers to unsaved state
+        if (partition->is_defrag_incomplete())
+        {
+            if (!partition->save_checkpoint(outchk.c_str()))
+                return 4;
+        }
+        else
+            remove(outchk.c_str());
     }
 
     if (dump_result || writeout_only)
@@ -74,6 +101,26 @@ int defrag_mode(const char* filename, const char* outfilename)
     return 0;
 }
 
+int plan_mode(const char* filename)
+{
+    // create partition record, planning does not need cluster contents either
+    fat_partition* partition = fat_partition::load_from_file(filename, mapped_image ? CLUSTER_MODE_MAPPED : CLUSTER_MODE_NONE);
+    if (!partition)
+        return 1;
+
+    cout << "Filesystem successfully loaded, proceeding with checks" << endl << endl;
+
+    // check for errors, plan has to be made on consistent filesystem, data for future use are cached by the same pass
+    if (!partition->check_and_cache())
+        return 2;
+
+    // plan moves, but do not move anything
+    if (!partition->plan_defragment())
+        return 3;
+
+    return 0;
+}
+
 int create_mode(const char* outfilename, uint32_t cluster_count, uint32_t cluster_size, uint32_t fat_type, uint32_t fat_copies, uint32_t reserv_clust_count, const char* volumedesc, const char* signature)
 {
     // create, if possible
@@ -278,6 +325,10 @@ int main(int argc, char** argv)
      *      -f          - force recoverable errors ignore
      *      -m          - matching mode for badblocks (recover from another FAT table)
      *      -w          - if some changes would be made, do not write it into file, or so
+     *      -mm         - map image file into memory instead of reading it
+     *      -st         - print statistics summary
+     *      -sj         - print statistics as JSON
+     *      -hw         - collect hardware counters (cycles, cache misses, branch misses) for statistics
      *
      *   -mc mode
      *      -cc <1;x>   - cluster count
@@ -296,6 +347,16 @@ int main(int argc, char** argv)
      *   -md mode
      *      -i <file>   - input filename            - default DEFAULT_INPUT_FILE macro value
      *      -o <file>   - output filename           - default DEFAULT_OUTPUT_FILE macro value
+     *      -dc         - use cycle rotation engine (does not need free space)
+     *      -pm         - use minimal movement placement (keeps contiguous files in place)
+     *      -bm <count> - stop after count of moves, and save checkpoint for next run  - default 0 (unlimited)
+     *      -bt <secs>  - stop after time in seconds, and save checkpoint for next run - default 0 (unlimited)
+     *      -ip         - in-place mode, cluster contents are moved directly in input file (output file is ignored)
+     *      -rl         - release used clusters, that does not belong to any file (they are kept by default)
+     *
+     *   -mp mode
+     *      -i <file>   - input filename            - default DEFAULT_INPUT_FILE macro value
+     *      -pm         - use minimal movement placement (keeps contiguous files in place)
      */
 
     for (i = 1; i < argc; i++)
@@ -340,6 +401,51 @@ int main(int argc, char** argv)
             cout << "Running in defragmentation mode" << endl;
             program_mode = PROGRAM_MODE_DEFRAG;
         }
+        else if (strcmp("-mp", argv[i]) == 0)
+        {
+            cout << "Running in defragmentation planning mode" << endl;
+            program_mode = PROGRAM_MODE_PLAN;
+        }
+        else if (strcmp("-dc", argv[i]) == 0)
+        {
+            cout << "Using cycle rotation defragmentation engine" << endl;
+            defrag_engine = DEFRAG_ENGINE_CYCLES;
+        }
+        else if (strcmp("-rl", argv[i]) == 0)
+        {
+            cout << "Releasing clusters, that does not belong to any file" << endl;
+            release_lost_clusters = true;
+        }
+        else if (strcmp("-ip", argv[i]) == 0)
+        {
+            cout << "Using in-place mode, input file will be modified" << endl;
+            in_place = true;
+        }
+        else if (strcmp("-mm", argv[i]) == 0)
+        {
+            cout << "Mapping image file into memory" << endl;
+            mapped_image = true;
+        }
+        else if (strcmp("-st", argv[i]) == 0)
+        {
+            cout << "Will print statistics summary" << endl;
+            stats_output = STATS_OUTPUT_TEXT;
+        }
+        else if (strcmp("-sj", argv[i]) == 0)
+        {
+            cout << "Will print statistics as JSON" << endl;
+            stats_output = STATS_OUTPUT_JSON;
+        }
+        else if (strcmp("-hw", argv[i]) == 0)
+        {
+            cout << "Will collect hardware counters" << endl;
+            hw_counters = true;
+        }
+        else if (strcmp("-pm", argv[i]) == 0)
+        {
+            cout << "Using minimal movement file placement" << endl;
+            placement_policy = PLACEMENT_POLICY_MINIMAL;
+        }
         else if (strcmp("-mc", argv[i]) == 0)
         {
             cout << "Running in creation mode" << endl;
@@ -397,6 +503,38 @@ int main(int argc, char** argv)
                 return 3;
             }
         }
+        else if (strcmp("-bm", argv[i]) == 0)
+        {
+            if (argc > i + 1)
+            {
+                defrag_move_budget = atoi(argv[i + 1]);
+                i++;
+
+                cout << "Defragmentation stops after " << defrag_move_budget << " moves" << endl;
+            }
+            else
+            {
+                cerr << "Error: move budget not specified after -bm" << endl;
+                cerr << "Please, specify move budget using -bm <count>" << endl;
+                return 3;
+            }
+        }
+        else if (strcmp("-bt", argv[i]) == 0)
+        {
+            if (argc > i + 1)
+            {
+                defrag_time_budget = atoi(argv[i + 1]);
+                i++;
+
+                cout << "Defragmentation stops after " << defrag_time_budget << " seconds" << endl;
+            }
+            else
+            {
+                cerr << "Error: time budget not specified after -bt" << endl;
+                cerr << "Please, specify time budget using -bt <seconds>" << endl;
+                return 3;
+            }
+        }
         else if (strcmp("-cc", argv[i]) == 0)
         {
             if (argc > i + 1)
@@ -538,6 +676,7 @@ int main(int argc, char** argv)
         cout << "Mode not specified. Please, specify mode using one of following parameters: " << endl;
         cout << "    -mr    read mode" << endl
              << "    -md    defragmentation mode" << endl
+             << "    -mp    defragmentation planning mode" << endl
              << "    -mc    creation mode" << endl;
 
         return 5;
@@ -548,13 +687,16 @@ int main(int argc, char** argv)
         cout << "No input file specified, falling back to " << DEFAULT_INPUT_FILE << endl;
         filename = DEFAULT_INPUT_FILE;
     }
-    if (outfilename.length() == 0 && program_mode != PROGRAM_MODE_READ)
+    if (outfilename.length() == 0 && program_mode != PROGRAM_MODE_READ && program_mode != PROGRAM_MODE_PLAN)
     {
         cout << "No output file specified, falling back to " << DEFAULT_OUTPUT_FILE << endl;
         outfilename = DEFAULT_OUTPUT_FILE;
     }
     cout << "Using " << (uint32_t)thread_count << " worker threads" << endl;
 
+    // counters has to be opened before any worker thread starts, so they are inherited
+    if (hw_counters && !profile_open_counters())
+        cerr << "Hardware counters are not available, only times will be measured" << endl;
 
     switch (program_mode)
     {
@@ -564,10 +706,17 @@ int main(int argc, char** argv)
         case PROGRAM_MODE_DEFRAG:
             defrag_mode(filename.c_str(), outfilename.c_str());
             break;
+        case PROGRAM_MODE_PLAN:
+            plan_mode(filename.c_str());
+            break;
         case PROGRAM_MODE_CREATE:
             create_mode(outfilename.c_str(), cluster_count, cluster_size, fat_type, fat_count, reserved_clusters, vol_descriptor.c_str(), signature.c_str());
             break;
     }
 
+    // phase times are measured always, printed only on request
+    if (stats_output != STATS_OUTPUT_NONE)
+        profile_report();
+
     return 0;
 }
@@ -0,0 +1,174 @@
+#include "global.h"
+#include "profiler.h"
+
+#include <vector>
+#include <chrono>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// totals of one phase
+struct profile_record
+{
+    const char* name;                                       // name of phase
+    uint32_t    calls;                                      // how many times the phase ran
+    uint64_t    wall_ns;                                    // wall time of all runs
+    uint64_t    counters[PROFILE_HW_COUNTERS];              // hardware counters of all runs
+};
+
+// names of hardware counters in JSON output
+static const char* profile_counter_names[PROFILE_HW_COUNTERS] = { "cycles", "cache_misses", "branch_misses" };
+// names of hardware counters in summary
+static const char* profile_counter_labels[PROFILE_HW_COUNTERS] = { "cycles", "cache misses", "branch misses" };
+
+// finished phases in order of their first run
+static std::vector<profile_record> profile_records;
+// hardware counter descriptors, -1 when counter is not opened
+static int profile_counter_fds[PROFILE_HW_COUNTERS] = { -1, -1, -1 };
+// were all hardware counters opened?
+static bool profile_counters_open = false;
+
+static uint64_t profile_clock()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef __linux__
+
+bool profile_open_counters()
+{
+    const uint64_t configs[PROFILE_HW_COUNTERS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+    struct perf_event_attr attr;
+    int i;
+
+    for (i = 0; i < PROFILE_HW_COUNTERS; i++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        // worker threads started later are counted too (their counts are added when they exit)
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        profile_counter_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (profile_counter_fds[i] < 0)
+        {
+            // either all counters, or none of them
+            while (i-- > 0)
+            {
+                close(profile_counter_fds[i]);
+                profile_counter_fds[i] = -1;
+            }
+            return false;
+        }
+    }
+
+    profile_counters_open = true;
+    return true;
+}
+
+static void profile_read_counters(uint64_t* values)
+{
+    int i;
+
+    for (i = 0; i < PROFILE_HW_COUNTERS; i++)
+    {
+        values[i] = 0;
+        if (profile_counters_open && read(profile_counter_fds[i], &values[i], sizeof(uint64_t)) != sizeof(uint64_t))
+            values[i] = 0;
+    }
+}
+
+#else
+
+bool profile_open_counters()
+{
+    // hardware counters are supported only through perf events
+    return false;
+}
+
+static void profile_read_counters(uint64_t* values)
+{
+    int i;
+
+    for (i = 0; i < PROFILE_HW_COUNTERS; i++)
+        values[i] = 0;
+}
+
+#endif
+
+profile_phase::profile_phase(const char* phase_name)
+{
+    name = phase_name;
+    profile_read_counters(start_counters);
+    start_time = profile_clock();
+}
+
+profile_phase::~profile_phase()
+{
+    uint64_t end_time = profile_clock();
+    uint64_t end_counters[PROFILE_HW_COUNTERS];
+    size_t i;
+    int j;
+
+    profile_read_counters(end_counters);
+
+    for (i = 0; i < profile_records.size(); i++)
+    {
+        if (strcmp(profile_records[i].name, name) == 0)
+            break;
+    }
+    if (i == profile_records.size())
+    {
+        profile_record record;
+        memset(&record, 0, sizeof(profile_record));
+        record.name = name;
+        profile_records.push_back(record);
+    }
+
+    profile_records[i].calls++;
+    profile_records[i].wall_ns += end_time - start_time;
+    for (j = 0; j < PROFILE_HW_COUNTERS; j++)
+        profile_records[i].counters[j] += end_counters[j] - start_counters[j];
+}
+
+void profile_report()
+{
+    size_t i;
+    int j;
+
+    if (stats_output == STATS_OUTPUT_JSON)
+        cout << "{\"profile\":{\"hw_counters\":" << (profile_counters_open ? "true" : "false") << ",\"phases\":[";
+    else
+        cout << "Profile:" << endl;
+
+    for (i = 0; i < profile_records.size(); i++)
+    {
+        const profile_record& rec = profile_records[i];
+
+        if (stats_output == STATS_OUTPUT_JSON)
+        {
+            cout << (i > 0 ? "," : "") << "{\"phase\":\"" << rec.name << "\",\"calls\":" << rec.calls << ",\"wall_ms\":" << rec.wall_ns / 1000000.0;
+            for (j = 0; profile_counters_open && j < PROFILE_HW_COUNTERS; j++)
+                cout << ",\"" << profile_counter_names[j] << "\":" << rec.counters[j];
+            cout << "}";
+        }
+        else
+        {
+            cout << "  " << rec.name << ": " << rec.wall_ns / 1000000.0 << " ms";
+            if (rec.calls > 1)
+                cout << " in " << rec.calls << " calls";
+            for (j = 0; profile_counters_open && j < PROFILE_HW_COUNTERS; j++)
+                cout << ", " << rec.counters[j] << " " << profile_counter_labels[j];
+            cout << endl;
+        }
+    }
+
+    if (stats_output == STATS_OUTPUT_JSON)
+        cout << "]}}" << endl;
+}
@@ -0,0 +1,30 @@
+#ifndef ZOS_PROFILER_H
+#define ZOS_PROFILER_H
+
+#include <stdint.h>
+
+// number of hardware counters collected for every phase (cycles, cache misses, branch misses)
+#define PROFILE_HW_COUNTERS 3
+
+// opens hardware counters, has to be called before any worker thread is started; returns false when they are not available
+bool profile_open_counters();
+// prints times and counters of all finished phases, as summary or JSON by selected statistics output
+void profile_report();
+
+// measures one phase of program from construction to destruction; phases with the same name are summed
+class profile_phase
+{
+    private:
+        // name of phase
+        const char* name;
+        // wall clock at phase start, in nanoseconds
+        uint64_t start_time;
+        // hardware counters at phase start
+        uint64_t start_counters[PROFILE_HW_COUNTERS];
+
+    public:
+        profile_phase(const char* phase_name);
+        ~profile_phase();
+};
+
+#endif
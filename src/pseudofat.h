@@ -9,6 +9,11 @@
 #include <vector>
 #include <queue>
 #include <deque>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+
+#include "cluster_bitmap.h"
 
 // unused cluster
 #define FAT_UNUSED      65535
@@ -20,6 +25,11 @@
 // just alias for several return values
 #define FAT_UNUSED_NOT_FOUND FAT_UNUSED
 
+// cluster has no predecessor (not part of any chain)
+#define FAT_PREDECESSOR_NONE     0xFFFFFFFF
+// predecessor flag - lower bits are index of root directory entry, not cluster
+#define FAT_PREDECESSOR_ROOTDIR  0x80000000
+
 // volume descriptor string length
 #define FAT_VOLUME_DESC_SIZE    251
 // signature string length
@@ -32,8 +42,45 @@
 // maximum number of recoverable errors for partition
 #define MAX_RECOVERABLE_ERRORS  20
 
-// count / MIN_DEFRAG_FREE_FRACTION clusters has to be free 
-#define MIN_DEFRAG_FREE_FRACTION 1
+// cluster contents are loaded into memory
+#define CLUSTER_MODE_MEMORY 0
+// cluster contents stays in image file and are moved there (in-place mode)
+#define CLUSTER_MODE_DISK   1
+// whole image is mapped into memory privately, changes are written back only by saving
+#define CLUSTER_MODE_MAPPED 2
+// cluster contents are not loaded at all (metadata-only checks)
+#define CLUSTER_MODE_NONE   4
+
+// size of one chunk read by parallel loader thread
+#define LOAD_CHUNK_SIZE (4 * 1024 * 1024)
+
+// number of FAT entries tracked by one dirty flag
+#define FAT_DIRTY_PAGE_ENTRIES 1024
+// number of FAT entries compared at once when checking FAT copies
+#define FAT_COMPARE_BLOCK_ENTRIES 16384
+// maximum size of one write of dirty clusters
+#define SAVE_CHUNK_SIZE (4 * 1024 * 1024)
+// maximum size of contiguous run of clusters moved at once by queue engine
+#define MOVE_RUN_MAX_SIZE (4 * 1024 * 1024)
+
+// journal signature
+#define JOURNAL_SIGNATURE "JRNL"
+// journal filename suffix (appended to image filename)
+#define JOURNAL_SUFFIX ".journal"
+// amount of cluster data moved between two journal commits during in-place defragmentation
+#define JOURNAL_BATCH_SIZE (16 * 1024 * 1024)
+
+// journal record - contents of FAT tables
+#define JOURNAL_RECORD_FAT      1
+// journal record - root directory entries
+#define JOURNAL_RECORD_ROOTDIR  2
+// journal record - cluster contents
+#define JOURNAL_RECORD_CLUSTERS 3
+
+// defragmentation checkpoint signature
+#define DEFRAG_CHECKPOINT_SIGNATURE "DCHK"
+// defragmentation checkpoint filename suffix (appended to image filename)
+#define DEFRAG_CHECKPOINT_SUFFIX ".chk"
 
 // bootrecord structure
 struct boot_record
@@ -58,31 +105,134 @@ struct root_directory
     uint32_t    first_cluster;                              // first cluster to begin chain with
 };
 
+// run of consecutive clusters in file chain
+struct cluster_extent
+{
+    uint32_t    start;                                      // first cluster of run
+    uint32_t    length;                                     // number of clusters in run
+};
+
+// sequence of cluster moves, that has to be done in order
+struct defrag_move_chain
+{
+    std::vector<uint32_t> clusters;                         // clusters to be moved; target of every cluster is previous cluster in vector
+    bool        cycle;                                      // is this a cycle? (target of first cluster is the last one)
+    uint32_t    moved;                                      // number of clusters already moved (chain may be stopped by budget)
+};
+
+// size of CPU cache line
+#define CACHE_LINE_SIZE 64
+
+// counters of one defragmentation worker; 8 counters fill one cache line, and the array is allocated aligned, so workers don't share them
+struct alignas(CACHE_LINE_SIZE) defrag_thread_stats
+{
+    uint64_t    moves;                                      // move operations (runs of clusters, chains or cycles)
+    uint64_t    clusters;                                   // clusters moved
+    uint64_t    retries;                                    // moves, that had to take locks again for regions of chain neighbours
+    uint64_t    reserve_failures;                           // clusters, that could not be reserved (taken by another worker)
+    uint64_t    waits;                                      // waits for ready clusters
+    uint64_t    cycle_breaks;                               // clusters moved aside to break cycles
+    uint64_t    queue_wait_ns;                              // time spent waiting for ready queue lock and ready clusters
+    uint64_t    region_wait_ns;                             // time spent waiting for region locks
+};
+
+// defragmentation checkpoint header; followed by first clusters of all files, file base offsets and work queue
+struct defrag_checkpoint
+{
+    char        signature[FAT_SIGNATURE_SIZE];              // checkpoint signature
+    uint32_t    cluster_count;                              // count of clusters of checkpointed partition
+    int64_t     root_directory_max_entries_count;           // root directory entries count of checkpointed partition
+    uint32_t    queue_length;                               // count of clusters remaining in work queue
+};
+
+// journal header; followed by records, valid only when checksum of all records matches
+struct journal_header
+{
+    char        signature[FAT_SIGNATURE_SIZE];              // journal signature
+    uint32_t    record_count;                               // count of records
+    uint64_t    payload_length;                             // length of all records (with their headers)
+    uint64_t    checksum;                                   // checksum of all records
+};
+
+// journal record header; followed by data to be written to image
+struct journal_record
+{
+    uint32_t    type;                                       // record type (JOURNAL_RECORD_*)
+    uint32_t    length;                                     // length of data
+    int64_t     offset;                                     // position of data in image file
+};
+
+// part of image file to be read by loader thread
+struct image_read_job
+{
+    uint8_t*    buffer;                                     // where to read
+    size_t      length;                                     // number of bytes to read
+    int64_t     offset;                                     // position in image file
+};
+
+// ready clusters of one worker thread
+struct defrag_work_queue
+{
+    std::mutex  mtx;                                        // owner takes work from front, other threads steal from back
+    std::deque<uint32_t> clusters;                          // clusters, which targets are free
+};
+
 // fat partition class
 class fat_partition
 {
     private:
-        // checks cluster chain in all FAT tables and reports errors; returns true if only recoverable errors found
-        bool _check_cluster_chain_everywhere(uint32_t start_cluster);
+        // checks cluster entry in all FAT tables and recovers it if possible; returns true if only recoverable errors found
+        bool _check_cluster_everywhere(uint32_t cluster, std::ostream& out);
 
         // finds free cluster from partition end
         uint32_t _find_free_cluster_end(int32_t end_offset = 0);
 
-        // moves cluster contents from source to destination cluster, and performs changes in FAT tables chains
-        bool _move_cluster(uint32_t source, uint32_t dest, int32_t thread_id = -1);
+        // moves run of count chained clusters from source to free destination run, and performs changes in FAT tables chains
+        bool _move_cluster(uint32_t source, uint32_t dest, uint32_t count, int32_t thread_id = -1);
+        // moves claimed cluster, and run of clusters following it when requested, with all regions touched by the move locked;
+        // returns count of moved clusters (run is limited by budget)
+        uint32_t _move_cluster_run(uint32_t source, uint32_t dest, uint32_t thread_id, bool extend_run);
+        // claims clusters following already claimed source, that continues to following targets inside of locked regions; returns run length
+        uint32_t _claim_cluster_run(uint32_t source, uint32_t dest, uint32_t thread_id, uint32_t regions);
+        // locks all regions in mask
+        void _lock_regions(uint32_t regions, uint32_t thread_id);
+        // unlocks all regions in mask
+        void _unlock_regions(uint32_t regions);
+        // retrieves region of cluster
+        uint32_t _cluster_region(uint32_t id);
+        // moves contents of count clusters from source to destination (swaps them in memory, copies them in image file)
+        void _transfer_cluster(uint32_t source, uint32_t dest, uint32_t count = 1);
+        // reads contents of count consecutive clusters from image file
+        bool _read_cluster_data(uint32_t index, uint8_t* buffer, uint32_t count = 1);
+        // writes contents of count consecutive clusters to image file
+        bool _write_cluster_data(uint32_t index, const uint8_t* buffer, uint32_t count = 1);
         // is cluster available for use?
         bool _is_cluster_available(uint32_t id);
         // is cluster marked as BAD?
         bool _is_cluster_bad(uint32_t id);
+        // does cluster stay at its position? (bad clusters and clusters outside of any file)
+        bool _is_cluster_fixed(uint32_t id);
 
         // reads bootrecord from file
         bool _read_bootrecord(FILE* f);
-        // reads FAT tables from file (needs to have bootrecord loaded) from file
-        bool _read_fat_tables(FILE* f);
         // reads all root directory entries from file
         bool _read_root_directory(FILE* f);
-        // reads cluster contents from file
-        bool _read_clusters(FILE* f);
+        // allocates memory block for all cluster contents
+        bool _allocate_cluster_arena();
+        // retrieves contents of cluster
+        uint8_t* _cluster_data(uint32_t index);
+        // checks, that file is large enough for all structures specified in bootrecord
+        bool _check_image_size(FILE* f);
+        // reads FAT tables (and cluster contents if requested) using positioned reads of all threads, root directory in the meantime
+        bool _read_image_parallel(FILE* f, const char* filename, bool with_clusters);
+        // adds job for loader threads, big ranges are split to chunks
+        void _add_read_jobs(uint8_t* buffer, uint64_t length, int64_t offset);
+        // opens image file for in-place access to cluster contents
+        bool _open_clusters(const char* filename);
+        // points all structures into mapped image; returns false if image is too small
+        bool _map_image(uint8_t* image, size_t size, int mode);
+        // are cluster contents moved in image file rather than by swapping slots?
+        bool _clusters_in_file();
 
         // creates bootrecord from supplied parameters
         bool _create_bootrecord(const char* volume_desc, int32_t fat_type, int32_t fat_copies, uint32_t cluster_size, uint32_t cluster_count, uint32_t reserver_cluster_count, const char* signature);
@@ -99,52 +249,235 @@ class fat_partition
         bool _write_root_directory(FILE* f);
         // writes cluster contents to file
         bool _write_clusters(FILE* f);
-
-        // checks FAT tables for file consistency
+        // writes metadata back to opened image file (cluster contents are already there)
+        bool _save_in_place();
+        // writes only changed FAT pages, root directory entries and clusters to image file (or as records to journal)
+        bool _write_dirty_regions(int fd);
+        // writes one changed region to image file, or appends it as record to journal, when fd is journal
+        bool _emit_region(int fd, uint32_t type, int64_t offset, const uint8_t* data, size_t length);
+        // contents of changed cluster, which has to be written to image
+        const uint8_t* _dirty_cluster_data(uint32_t index);
+        // writes all changes to journal, then to image file; returns false if any write failed
+        bool _commit_changes(int fd);
+        // closes and removes journal, when all changes are safely in image
+        void _close_journal();
+        // finishes changes from committed journal of image, or discards incomplete one
+        static bool _recover_journal(const char* filename);
+        // starts tracking of changes from current state
+        void _reset_dirty();
+        // marks FAT entry (in all FAT tables) as changed
+        void _mark_fat_dirty(uint32_t index);
+        // marks root directory entry as changed
+        void _mark_rootdir_dirty(uint32_t index);
+        // marks cluster contents as changed
+        void _mark_cluster_dirty(uint32_t index);
+
+        // checks all file chains at once for loops, cross-links, lost clusters and size mismatches
         bool _check_fattables_files();
+        // number of clusters occupied by file of given size
+        uint32_t _size_to_clusters(int64_t size);
+        // checks chain of one root directory entry, claiming its clusters; returns CHAIN_CHECK_* result
+        uint8_t _check_file_chain(uint32_t index, std::ostream& out);
+        // number of recoverable errors found by checks
+        uint32_t recoverable_errors;
+
+        // owning root directory entry of every cluster during check
+        std::atomic<uint32_t>* check_owners;
+        // index of next root directory entry to be checked by checker thread
+        std::atomic<uint32_t> check_next_file;
+        // check result of every root directory entry
+        std::vector<uint8_t> check_status;
+        // messages of every root directory entry check, printed in order after all threads finish
+        std::vector<std::string> check_reports;
+        // position in chain, at which check of every root directory entry failed
+        std::vector<uint32_t> check_fail_pos;
+        // positions in chain and report offsets of recovery messages of every root directory entry
+        std::vector<std::vector<std::pair<uint32_t, size_t> > > check_report_marks;
+        // flags of root directory entries, which clusters were claimed by entry with lower index
+        std::atomic<uint8_t>* check_conflicts;
+        // marks beginning of failure message in report of root directory entry check; returns the report
+        std::ostream& _chain_failure(uint32_t index, std::ostream& out);
+        // prints report of the first broken root directory entry as if chains were checked one by one
+        void _report_broken_chain(uint32_t index);
+        // guards dirty flags during recovery in checker threads
+        std::mutex check_mtx;
         // checks FAT tables for equal values
         bool _check_fattables_equal();
 
-        // looks for n-th free cluster from partition beginning
+        // looks for n-th free cluster from partition beginning (counted from 0)
         uint32_t _find_nth_free_cluster(uint32_t n);
-        // sets entry in FAT table
-        void _set_fat_entry(uint32_t index, uint32_t value);
+        // sets entry in FAT table; fails, when index is outside of FAT table
+        bool _set_fat_entry(uint32_t index, uint32_t value);
         // sets contents of cluster
         void _set_cluster_content(uint32_t index, const char* content);
 
         // array of file base offsets
         uint32_t* file_base_offsets;
-        // farmer-worker assigning mutex
-        std::mutex assign_mtx;
-        // cluster contents move mutex
-        std::mutex move_mtx;
+        // array of target positions of all clusters (bad clusters already skipped)
+        uint32_t* cluster_targets;
+        // mutexes of cluster regions - each worker owns one region, moves lock all regions they touch
+        std::mutex* region_mutexes;
+        // number of clusters in one region
+        uint32_t region_size;
+
+        // computes base offsets of all files
+        void _compute_file_base_offsets();
+        // computes base offsets so the least clusters has to be moved; returns false if files does not fit into gaps
+        bool _compute_file_base_offsets_minimal();
+        // splits cluster moves into independent chains and cycles; returns false if targets cannot be reached
+        bool _plan_move_chains();
+        // performs first count moves in chain, uses single scratch slot for cycles (cycles are always moved whole)
+        void _rotate_move_chain(const defrag_move_chain& chain, uint32_t count, uint32_t thread_id);
+        // takes count moves from defragmentation budget; returns number of moves, that could be done
+        uint32_t _consume_defrag_budget(uint32_t count);
+        // rewrites FAT tables and root directory after all chains were moved
+        void _relink_moved_clusters();
+        // rebuilds cached extents from primary FAT table
+        void _recache_chains();
+        // runs one defragmentation pass of selected engine with move limit (0 means unlimited)
+        bool _defragment_round(uint32_t move_limit);
+        // runs defragmentation in rounds, every round is committed through journal
+        bool _defragment_journaled();
+        // defragments by moving clusters, which targets are free, in order given by dependencies between moves
+        bool _defragment_queue();
+        // defragments using rotation of permutation cycles
+        bool _defragment_cycles();
 
         // queue of all clusters to be processed
         std::deque<uint32_t> occupied_clusters_to_work;
-        // vector of cluster chains
-        std::vector<uint32_t>* rootdir_cluster_chains;
-
-        // number of free clusters needed for defragmentation
-        uint32_t free_space_size;
+        // claim flags of clusters - 0 means waiting to be moved, 1 means processed (or being processed) by some thread
+        std::atomic<uint8_t>* cluster_claims;
+        // cluster waiting for every position to be vacated (cluster, which target the position is)
+        uint32_t* move_dependents;
+        // clusters, which targets are free, in queue of the thread owning region of their target
+        defrag_work_queue* thread_work_queues;
+        // number of clusters in all work queues
+        std::atomic<uint32_t> ready_count;
+        // guards cycle breaking and end of round, idle workers waits on it
+        std::mutex ready_mtx;
+        // signals new ready clusters, quiet round and end of work to idle workers
+        std::condition_variable ready_cv;
+        // number of workers looking for work or moving clusters right now
+        std::atomic<uint32_t> active_workers;
+        // number of workers waiting for ready clusters
+        std::atomic<uint32_t> idle_workers;
+        // no cycle remains to be broken in this round
+        bool defrag_round_done;
+        // all clusters to be moved in this round, including the ones moved aside to break cycles
+        std::vector<uint32_t> round_clusters;
+        // position in round clusters, before which all clusters were already claimed
+        size_t cycle_scan_pos;
+        // counters of all defragmentation workers, collected during whole defragmentation
+        defrag_thread_stats* defrag_stats;
+        // memory of worker counters, new does not respect alignment of defrag_thread_stats before C++17
+        uint8_t* defrag_stats_memory;
+        // prints collected worker counters, as summary or JSON by selected statistics output
+        void _print_defrag_stats(uint64_t elapsed_ns);
+        // moves one cluster of a cycle aside to free cluster, when nothing else can be moved; returns false if nothing remains
+        bool _break_move_cycle(uint32_t thread_id);
+        // cluster chains of all files as extents in chain order
+        std::vector<cluster_extent>* rootdir_extents;
+        // appends cluster to extents, extends the last extent when cluster follows it
+        static void _append_extent(std::vector<cluster_extent>& extents, uint32_t cluster);
+        // number of clusters in chain of root directory entry
+        uint32_t _chain_length(uint32_t index);
+        // predecessor of every cluster - previous cluster in chain, or root directory entry (FAT_PREDECESSOR_ROOTDIR flag)
+        uint32_t* cluster_predecessors;
+        // bitmap of free clusters, kept in sync with primary FAT table
+        cluster_bitmap free_bitmap;
+        // bitmap of used clusters, that does not belong to any file; files are placed around them
+        cluster_bitmap lost_bitmap;
+
+        // chains and cycles of cluster moves
+        std::vector<defrag_move_chain> move_chains;
+        // index of next chain to be processed by worker
+        std::atomic<uint32_t> move_chain_next;
+
+        // number of moves taken from budget
+        std::atomic<uint32_t> defrag_moves_taken;
+        // maximum number of moves in current pass (0 means unlimited)
+        uint32_t move_budget_limit;
+        // time, when defragmentation has to stop
+        std::chrono::steady_clock::time_point defrag_deadline;
+        // is budget exhausted?
+        std::atomic<bool> defrag_budget_exhausted;
+        // has been defragmentation stopped before all clusters were placed?
+        bool defrag_incomplete;
+        // were file base offsets and work queue loaded from checkpoint?
+        bool checkpoint_loaded;
+
+        // where are cluster contents stored
+        int cluster_mode;
+        // image file descriptor for in-place access
+        int image_fd;
+        // offset of first cluster in image file
+        int64_t cluster_region_offset;
+        // did some read or write of cluster contents fail?
+        std::atomic<bool> cluster_io_failed;
+        // mapped image (in mapped modes)
+        uint8_t* image_map;
+        // size of mapped image
+        size_t image_map_size;
+
+        // parts of image file to be read by loader threads
+        std::vector<image_read_job> read_jobs;
+        // index of next job to be taken by loader thread
+        std::atomic<uint32_t> read_job_next;
+        // did some loader read fail?
+        std::atomic<bool> read_failed;
+
+        // file the image was loaded from (empty for created images)
+        std::string image_filename;
+        // FAT pages changed since load
+        cluster_bitmap dirty_fat_pages;
+        // root directory entries changed since load
+        cluster_bitmap dirty_rootdir;
+        // clusters with contents changed since load
+        cluster_bitmap dirty_clusters;
+
+        // journal file descriptor (-1 when not opened)
+        int journal_fd;
+        // length of records written to journal in current commit
+        uint64_t journal_length;
+        // count of records written to journal in current commit
+        uint32_t journal_records;
+        // checksum of records written to journal in current commit
+        uint64_t journal_checksum;
+        // clusters written during in-place defragmentation, that are waiting for commit (offset in pending_data)
+        std::unordered_map<uint32_t, size_t> pending_clusters;
+        // contents of pending clusters
+        std::vector<uint8_t> pending_data;
+        // lock of pending clusters
+        std::mutex pending_mtx;
 
     public:
+        fat_partition();
 
         // defragments loaded FAT partition
         bool defragment();
+        // prints ordered move plan of defragmentation with its cost, does not move anything
+        bool plan_defragment();
+        // was defragmentation stopped by budget?
+        bool is_defrag_incomplete();
+
+        // loads file placement and work queue from checkpoint file; returns false if there's no valid checkpoint
+        bool load_checkpoint(const char* filename);
+        // saves file placement and remaining work queue to checkpoint file
+        bool save_checkpoint(const char* filename);
 
         // dumps FAT partition contents
         void dump_contents();
-        // proceeds caching
+        // proceeds caching of newly created partition
         void cache_counts();
 
-        // checks FAT tables for errors
-        bool check_fattables();
+        // checks FAT tables for errors and caches chains, reverse links and cluster counts on the way
+        bool check_and_cache();
 
         // finds free cluster from beginning
         uint32_t find_free_cluster_begin();
 
-        // constructs fat_partition instance from file (filename supplied)
-        static fat_partition* load_from_file(const char* filename);
+        // constructs fat_partition instance from file (filename supplied), cluster contents are handled by supplied mode
+        static fat_partition* load_from_file(const char* filename, int cluster_mode = CLUSTER_MODE_MEMORY);
         // constructs fat_partition based on supplied arguments
         static fat_partition* create(const char* volume_desc, int32_t fat_type, int32_t fat_copies, uint32_t cluster_size, uint32_t cluster_count, uint32_t reserver_cluster_count = 10, const char* signature = "OK");
         // saves fat_partition to image file
@@ -167,23 +500,33 @@ class fat_partition
         // count of free clusters
         uint32_t        free_clusters_count;
 
-        // cluster contents
-        uint8_t**       clusters;
+        // cluster contents - all clusters in one block of memory
+        uint8_t*        cluster_arena;
+        // arena slot of every cluster (clusters are moved by swapping slots)
+        uint32_t*       cluster_slots;
 
         // thread-related stuff
 
-        // retrieves cluster to be defragmented
-        uint32_t get_thread_work_cluster(int32_t retback = -1);
-        // puts back cluster to queue for processing
-        void put_thread_work_cluster(int32_t retback);
-        // reserves custom found cluster for moving (returns true on success, or false when another thread got it)
+        // takes ready cluster from own queue, or steals it from another one; returns FAT_PREDECESSOR_NONE, when there's none
+        uint32_t get_thread_work_cluster(uint32_t threadid);
+        // puts cluster, which target is free, to the queue of thread owning region of its target
+        void put_thread_work_cluster(uint32_t entry);
+        // reserves cluster for moving (returns true on success, or false when another thread got it)
         bool get_thread_work_cluster_reserve(uint32_t entry);
 
+        // builds cluster target positions using file base offsets and cached chains
+        void build_cluster_targets();
         // retrieves cluster aligned position
         uint32_t get_aligned_position(uint32_t current);
 
         // thread worker
         void thread_process(uint32_t threadid);
+        // thread worker for cycle rotation engine
+        void cycle_thread_process(uint32_t threadid);
+        // thread worker for parallel loader
+        void load_thread_process(uint32_t threadid);
+        // thread worker for parallel chain check
+        void check_thread_process();
 };
 
 #endif
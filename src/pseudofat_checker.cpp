@@ -1,112 +1,430 @@
 #include "global.h"
 #include "pseudofat.h"
+#include "profiler.h"
 
 #include <map>
+#include <sstream>
 #include <string>
 #include <vector>
 
-bool fat_partition::_check_cluster_chain_everywhere(uint32_t start_cluster)
+bool fat_partition::_check_cluster_everywhere(uint32_t cluster, std::ostream& out)
 {
-    uint32_t clusternow = start_cluster;
     int i;
-    uint32_t limit_counter = 0;
 
-    while (clusternow != FAT_FILE_END)
+    // check for FAT tables consistency
+    // start from index 1 due to comparison with 0th table
+    for (i = 1; i < bootrec->fat_copies; i++)
     {
-        // check for FAT tables consistency
-        // start from index 1 due to comparison with 0th table
-        for (i = 1; i < bootrec->fat_copies; i++)
+        // if the record is not equal
+        if (fat_tables[0][cluster] != fat_tables[i][cluster])
         {
-            // if the record is not equal
-            if (fat_tables[0][clusternow] != fat_tables[i][clusternow])
+            // one of blocks is marked as BAD_CLUSTER
+            if (fat_tables[0][cluster] == FAT_BAD_CLUSTER || fat_tables[i][cluster] == FAT_BAD_CLUSTER)
             {
-                // one of blocks is marked as BAD_CLUSTER
-                if (fat_tables[0][clusternow] == FAT_BAD_CLUSTER || fat_tables[i][clusternow] == FAT_BAD_CLUSTER)
+                // when not matching bad blocks, return
+                if (!matching_badblocks)
                 {
-                    // when not matching bad blocks, return
-                    if (!matching_badblocks)
+                    out << "File contains errors, could not proceed. Use -m for attempt to recover badblocks in file chains" << endl;
+                    return false;
+                }
+                else
+                {
+                    // cross-linked cluster may be checked by two threads, only one of them recovers it;
+                    // dirty flags are shared with other checking threads too
+                    std::unique_lock<std::mutex> lock(check_mtx);
+                    if (fat_tables[0][cluster] == fat_tables[i][cluster])
+                        continue;
+
+                    // otherwise attempt to recover files from another FAT table
+                    out << "File contains errors, attempting recovery..." << endl;
+                    // use primary FAT to restore backup ones, when primary is not damaged
+                    if (fat_tables[0][cluster] != FAT_BAD_CLUSTER)
                     {
-                        cout << "File contains errors, could not proceed. Use -m for attempt to recover badblocks in file chains" << endl;
-                        return false;
+                        out << "Recovered using information from primary FAT table" << endl;
+                        fat_tables[i][cluster] = fat_tables[0][cluster];
                     }
-                    else
+                    else // otherwise fix primary table using data from backup tables
                     {
-                        // otherwise attempt to recover files from another FAT table
-                        cout << "File contains errors, attempting recovery..." << endl;
-                        // use primary FAT to restore backup ones, when primary is not damaged
-                        if (fat_tables[0][clusternow] != FAT_BAD_CLUSTER)
-                        {
-                            cout << "Recovered using information from primary FAT table" << endl;
-                            fat_tables[i][clusternow] = fat_tables[0][clusternow];
-                        }
-                        else // otherwise fix primary table using data from backup tables
-                        {
-                            cout << "Recovered using information from backup FAT table " << i << endl;
-                            fat_tables[0][clusternow] = fat_tables[i][clusternow];
-                        }
+                        out << "Recovered using information from backup FAT table " << i << endl;
+                        fat_tables[0][cluster] = fat_tables[i][cluster];
                     }
+
+                    _mark_fat_dirty(cluster);
                 }
             }
         }
+    }
+
+    // when all FAT tables contains the same information about damaged file, report it and end processing
+    if (fat_tables[0][cluster] == FAT_BAD_CLUSTER)
+    {
+        out << "File contains unrecoverable errors, could not proceed" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+// owner marks of lost clusters, root directory entry indexes are always lower
+#define LOST_CHAIN_START 0xFFFFFFFE
+#define LOST_CHAIN_NEXT  0xFFFFFFFD
+
+// results of file chain check
+#define CHAIN_CHECK_OK            0
+#define CHAIN_CHECK_SIZE_MISMATCH 1
+#define CHAIN_CHECK_FAILED        2
+
+uint32_t fat_partition::_size_to_clusters(int64_t size)
+{
+    // every file occupies at least one cluster
+    if (size <= 0)
+        return 1;
+
+    return (uint32_t)((size + bootrec->cluster_size - 1) / bootrec->cluster_size);
+}
+
+std::ostream& fat_partition::_chain_failure(uint32_t index, std::ostream& out)
+{
+    // failure message is marked as well, so it can be replaced by cross-link found at the same cluster
+    check_report_marks[index].push_back(std::make_pair(check_fail_pos[index], (size_t)out.tellp()));
+
+    return out;
+}
+
+uint8_t fat_partition::_check_file_chain(uint32_t index, std::ostream& out)
+{
+    uint32_t cl, owner, length = 0, expected;
+    uint32_t prev = FAT_PREDECESSOR_ROOTDIR | index;
+    std::streampos report_pos;
+    bool consistent;
+
+    for (cl = rootdir[index].first_cluster; cl != FAT_FILE_END; cl = fat_tables[0][cl])
+    {
+        // position stays recorded, when check fails at this cluster
+        check_fail_pos[index] = length;
+
+        if (cl == FAT_UNUSED)
+        {
+            _chain_failure(index, out) << "File " << rootdir[index].file_name << " continues to unused cluster" << endl;
+            return CHAIN_CHECK_FAILED;
+        }
 
-        // when all FAT tables contains the same information about damaged file, report it and end processing
-        if (fat_tables[0][clusternow] == FAT_BAD_CLUSTER)
+        // reserved clusters at the end of partition have no contents, so they can't be in chain either
+        if (cl >= real_cluster_count)
         {
-            cout << "File contains unrecoverable errors, could not proceed" << endl;
-            return false;
+            _chain_failure(index, out) << "File " << rootdir[index].file_name << " links to cluster " << cl << " outside of partition" << endl;
+            return CHAIN_CHECK_FAILED;
         }
 
-        // move to next cluster using primary FAT table
-        clusternow = fat_tables[0][clusternow];
+        // claim cluster for this file; file with lower index always takes it over, so the same file is found
+        // cross-linked regardless of order, in which threads get to the cluster
+        owner = FAT_PREDECESSOR_NONE;
+        while (!check_owners[cl].compare_exchange_weak(owner, index) && owner > index)
+            ;
+
+        if (owner == index)
+        {
+            _chain_failure(index, out) << "File " << rootdir[index].file_name << " contains loop at cluster " << cl << endl;
+            return CHAIN_CHECK_FAILED;
+        }
 
-        limit_counter++;
+        if (owner < index)
+        {
+            _chain_failure(index, out) << "File " << rootdir[index].file_name << " is cross-linked with file " << rootdir[owner].file_name << " at cluster " << cl << endl;
+            return CHAIN_CHECK_FAILED;
+        }
 
-        // detect loops
-        if (limit_counter > bootrec->cluster_count)
-            return false;
+        // cluster was taken over from later file, which is cross-linked then
+        if (owner != FAT_PREDECESSOR_NONE)
+            check_conflicts[owner] = 1;
+
+        report_pos = out.tellp();
+        consistent = _check_cluster_everywhere(cl, out);
+        if (out.tellp() != report_pos)
+            check_report_marks[index].push_back(std::make_pair(length, (size_t)report_pos));
+
+        if (!consistent)
+        {
+            _chain_failure(index, out) << "File " << rootdir[index].file_name << " is not consistent across FAT tables" << endl;
+            return CHAIN_CHECK_FAILED;
+        }
+
+        length++;
+
+        // cache chain and reverse links on the way, so they don't need another traversal;
+        // when the cluster was taken over, check fails anyway and the later file may still be writing them
+        if (owner == FAT_PREDECESSOR_NONE)
+        {
+            cluster_predecessors[cl] = prev;
+            _append_extent(rootdir_extents[index], cl);
+        }
+        prev = cl;
     }
 
-    return true;
+    check_fail_pos[index] = FAT_PREDECESSOR_NONE;
+
+    expected = _size_to_clusters(rootdir[index].file_size);
+    if (length != expected)
+    {
+        out << "Recoverable inconsistency: file " << rootdir[index].file_name << " has size " << rootdir[index].file_size << ", but occupies " << length << " clusters" << endl;
+        return CHAIN_CHECK_SIZE_MISMATCH;
+    }
+
+    return CHAIN_CHECK_OK;
+}
+
+void fat_partition::check_thread_process()
+{
+    uint32_t i;
+
+    while (true)
+    {
+        i = check_next_file++;
+        if (i >= check_status.size())
+            break;
+
+        std::ostringstream out;
+        check_status[i] = _check_file_chain(i, out);
+        check_reports[i] = out.str();
+    }
+}
+
+void check_thread_fnc(fat_partition* partition)
+{
+    partition->check_thread_process();
+}
+
+void fat_partition::_report_broken_chain(uint32_t index)
+{
+    uint32_t cl, pos;
+    size_t i, length = check_reports[index].size();
+
+    // find the first cluster claimed by earlier file; clusters before the failure of this file's own check
+    // belongs to this file only, so there's no loop among them
+    for (pos = 0, cl = rootdir[index].first_cluster; ; pos++, cl = fat_tables[0][cl])
+    {
+        if (cl == FAT_FILE_END || cl == FAT_UNUSED || cl >= real_cluster_count || check_owners[cl] < index || pos == check_fail_pos[index])
+            break;
+    }
+
+    // failure of this file's own check comes first, and its report ends with it
+    if (cl == FAT_FILE_END || cl == FAT_UNUSED || cl >= real_cluster_count || check_owners[cl] >= index)
+    {
+        cout << check_reports[index];
+        return;
+    }
+
+    // otherwise drop everything, that was reported for clusters behind the cross-link
+    for (i = 0; i < check_report_marks[index].size(); i++)
+    {
+        if (check_report_marks[index][i].first >= pos)
+        {
+            length = check_report_marks[index][i].second;
+            break;
+        }
+    }
+
+    cout << check_reports[index].substr(0, length);
+    cout << "File " << rootdir[index].file_name << " is cross-linked with file " << rootdir[(uint32_t)check_owners[cl]].file_name << " at cluster " << cl << endl;
 }
 
 bool fat_partition::_check_fattables_files()
 {
-    int i;
+    uint32_t i, cl, pass, orphans = 0, lost_chains = 0, walks = 0;
+    bool failed = false;
 
-    // go through all root directory files and check them for consistency across all FAT tables
+    // owner of every cluster - every cluster may be visited only once, so all chains are checked in linear time
+    check_owners = new std::atomic<uint32_t>[bootrec->cluster_count];
+    check_conflicts = new std::atomic<uint8_t>[(uint32_t)bootrec->root_directory_max_entries_count];
+    cluster_predecessors = new uint32_t[bootrec->cluster_count];
+    for (i = 0; i < bootrec->cluster_count; i++)
+    {
+        check_owners[i] = FAT_PREDECESSOR_NONE;
+        cluster_predecessors[i] = FAT_PREDECESSOR_NONE;
+    }
+
+    // chains are cached by checker threads, each thread fills only chains of files it checks
+    rootdir_extents = new std::vector<cluster_extent>[(uint32_t)bootrec->root_directory_max_entries_count];
+
+    check_status.assign((size_t)bootrec->root_directory_max_entries_count, CHAIN_CHECK_OK);
+    check_reports.assign((size_t)bootrec->root_directory_max_entries_count, std::string());
+    check_fail_pos.assign((size_t)bootrec->root_directory_max_entries_count, FAT_PREDECESSOR_NONE);
+    check_report_marks.assign((size_t)bootrec->root_directory_max_entries_count, std::vector<std::pair<uint32_t, size_t> >());
     for (i = 0; i < bootrec->root_directory_max_entries_count; i++)
+        check_conflicts[i] = 0;
+    check_next_file = 0;
+
+    recoverable_errors = 0;
+
+    // go through all root directory files and check them for consistency across all FAT tables
+    std::thread** workers = new std::thread*[thread_count];
+    for (i = 0; i < thread_count; i++)
+        workers[i] = new std::thread(check_thread_fnc, this);
+
+    for (i = 0; i < thread_count; i++)
     {
-        if (!_check_cluster_chain_everywhere(rootdir[i].first_cluster))
+        workers[i]->join();
+        delete workers[i];
+    }
+    delete[] workers;
+
+    // report in root directory order, up to the first broken file
+    for (i = 0; i < check_status.size() && !failed; i++)
+    {
+        if (check_status[i] == CHAIN_CHECK_FAILED || check_conflicts[i] != 0)
         {
-            cout << "File " << rootdir[i].file_name << " is not consistent across FAT tables" << endl;
-            return false;
+            _report_broken_chain(i);
+            failed = true;
+            break;
         }
+
+        cout << check_reports[i];
+
+        if (check_status[i] == CHAIN_CHECK_SIZE_MISMATCH)
+            recoverable_errors++;
     }
 
+    check_reports.clear();
+    check_status.clear();
+    check_fail_pos.clear();
+    check_report_marks.clear();
+    delete[] check_conflicts;
+    check_conflicts = nullptr;
+
+    if (failed)
+    {
+        delete[] check_owners;
+        check_owners = nullptr;
+        return false;
+    }
+
+    free_bitmap.resize(real_cluster_count);
+    lost_bitmap.resize(real_cluster_count);
+    free_clusters_count = 0;
+
+    // single pass through FAT caches free and occupied clusters and finds lost ones
+    for (i = 0; i < bootrec->cluster_count; i++)
+    {
+        cl = fat_tables[0][i];
+
+        if (cl == FAT_UNUSED)
+        {
+            free_clusters_count++;
+            if (i < real_cluster_count)
+                free_bitmap.set(i);
+            continue;
+        }
+
+        if (cl == FAT_BAD_CLUSTER)
+            continue;
+
+        // used clusters, that does not belong to any file, are lost
+        if (check_owners[i] != FAT_PREDECESSOR_NONE)
+        {
+            occupied_clusters_to_work.push_back(i);
+            continue;
+        }
+
+        check_owners[i] = LOST_CHAIN_START;
+        orphans++;
+        if (verbose_output)
+            cout << "Cluster " << i << " does not belong to any file" << endl;
+    }
+
+    if (orphans > 0)
+    {
+        // lost clusters pointed to by another lost cluster are not beginnings of lost chains
+        for (i = 0; i < bootrec->cluster_count; i++)
+        {
+            cl = fat_tables[0][i];
+            if ((check_owners[i] == LOST_CHAIN_START || check_owners[i] == LOST_CHAIN_NEXT) && cl < bootrec->cluster_count && check_owners[cl] == LOST_CHAIN_START)
+                check_owners[cl] = LOST_CHAIN_NEXT;
+        }
+
+        // walk lost chains from their beginnings at first; clusters, that remain, are in loops without beginning,
+        // and every walk, that ends in cluster visited by itself, found another such loop
+        std::vector<uint32_t> walked(bootrec->cluster_count, 0);
+        for (pass = 0; pass < 2; pass++)
+        {
+            for (i = 0; i < bootrec->cluster_count; i++)
+            {
+                if ((pass == 0) ? (check_owners[i] != LOST_CHAIN_START) : (check_owners[i] != LOST_CHAIN_NEXT || walked[i] != 0))
+                    continue;
+
+                walks++;
+                for (cl = i; cl < bootrec->cluster_count && (check_owners[cl] == LOST_CHAIN_START || check_owners[cl] == LOST_CHAIN_NEXT) && walked[cl] == 0; cl = fat_tables[0][cl])
+                    walked[cl] = walks;
+
+                if (pass == 0 || (cl < bootrec->cluster_count && walked[cl] == walks))
+                    lost_chains++;
+            }
+        }
+
+        for (i = 0; i < bootrec->cluster_count; i++)
+        {
+            if (check_owners[i] != LOST_CHAIN_START && check_owners[i] != LOST_CHAIN_NEXT)
+                continue;
+
+            // lost clusters are released only on request, otherwise they stay where they are and files are placed around them
+            if (release_lost_clusters)
+            {
+                _set_fat_entry(i, FAT_UNUSED);
+                free_clusters_count++;
+            }
+            else if (i < real_cluster_count)
+                lost_bitmap.set(i);
+        }
+
+        cout << "Recoverable inconsistency: " << orphans << " used clusters in " << lost_chains << " chains does not belong to any file" << (release_lost_clusters ? ", releasing them" : "") << endl;
+        recoverable_errors += lost_chains;
+    }
+
+    delete[] check_owners;
+    check_owners = nullptr;
+
     return true;
 }
 
 bool fat_partition::_check_fattables_equal()
 {
-    int incons = 0;
-    uint32_t i;
+    uint32_t i, block, block_end;
     int32_t j;
 
-    // check all cluster references
-    for (i = 0; i < bootrec->cluster_count; i++)
+    // errors found by chain check counts too
+    if (recoverable_errors > MAX_RECOVERABLE_ERRORS)
+        return false;
+
+    // compare whole blocks at first, mismatching ones are then checked entry by entry
+    for (block = 0; block < bootrec->cluster_count; block += FAT_COMPARE_BLOCK_ENTRIES)
     {
-        // check in all fat copies
+        block_end = std::min(block + FAT_COMPARE_BLOCK_ENTRIES, bootrec->cluster_count);
+
         for (j = 1; j < bootrec->fat_copies; j++)
         {
-            // they has to be equal
-            // if not, it is recognized as recoverable error (some "lost" file remaining on partition, etc.)
-            if (fat_tables[0][i] != fat_tables[j][i])
+            if (memcmp(&fat_tables[0][block], &fat_tables[j][block], sizeof(uint32_t)*(block_end - block)) != 0)
+                break;
+        }
+
+        // all copies of block are equal
+        if (j == bootrec->fat_copies)
+            continue;
+
+        // check all cluster references
+        for (i = block; i < block_end; i++)
+        {
+            // check in all fat copies
+            for (j = 1; j < bootrec->fat_copies; j++)
             {
-                cout << "Recoverable inconsistency at cluster " << i << " on FAT table " << i << endl;
+                // they has to be equal
+                // if not, it is recognized as recoverable error (some "lost" file remaining on partition, etc.)
+                if (fat_tables[0][i] != fat_tables[j][i])
+                {
+                    cout << "Recoverable inconsistency at cluster " << i << " on FAT table " << j << endl;
 
-                incons++;
-                if (incons > MAX_RECOVERABLE_ERRORS)
-                    return false;
+                    recoverable_errors++;
+                    if (recoverable_errors > MAX_RECOVERABLE_ERRORS)
+                        return false;
+                }
             }
         }
     }
@@ -114,8 +432,11 @@ bool fat_partition::_check_fattables_equal()
     return true;
 }
 
-bool fat_partition::check_fattables()
+bool fat_partition::check_and_cache()
 {
+    profile_phase phase("check");
+
+    // chains, reverse links and counts are cached by the same pass, that checks them
     cout << "Checking FAT tables consistency..." << endl;
     if (!_check_fattables_files())
     {
@@ -135,29 +456,86 @@ bool fat_partition::check_fattables()
 
 void fat_partition::cache_counts()
 {
+    profile_phase phase("cache");
     uint32_t i, j;
 
+    cluster_predecessors = new uint32_t[bootrec->cluster_count];
+    for (i = 0; i < bootrec->cluster_count; i++)
+        cluster_predecessors[i] = FAT_PREDECESSOR_NONE;
+
+    free_bitmap.resize(real_cluster_count);
+    lost_bitmap.resize(real_cluster_count);
+
     // cache count of free clusters
     free_clusters_count = 0;
     for (i = 0; i < bootrec->cluster_count; i++)
     {
-        if (fat_tables[0][i] == FAT_UNUSED)
+        j = fat_tables[0][i];
+
+        if (j == FAT_UNUSED)
+        {
             free_clusters_count++;
-        else if (fat_tables[0][i] != FAT_BAD_CLUSTER)
+            if (i < real_cluster_count)
+                free_bitmap.set(i);
+        }
+        else if (j != FAT_BAD_CLUSTER)
+        {
             occupied_clusters_to_work.push_back(i);
+
+            // remember reverse link, so we don't need to look for it when moving clusters
+            if (j != FAT_FILE_END && j < bootrec->cluster_count)
+                cluster_predecessors[j] = i;
+        }
     }
 
+    // chain beginnings are referenced from root directory
+    for (i = 0; i < bootrec->root_directory_max_entries_count; i++)
+        cluster_predecessors[rootdir[i].first_cluster] = FAT_PREDECESSOR_ROOTDIR | i;
+
     // cache cluster chains
-    rootdir_cluster_chains = new std::vector<uint32_t>[(uint32_t)bootrec->root_directory_max_entries_count];
+    rootdir_extents = new std::vector<cluster_extent>[(uint32_t)bootrec->root_directory_max_entries_count];
+    _recache_chains();
+}
+
+void fat_partition::_append_extent(std::vector<cluster_extent>& extents, uint32_t cluster)
+{
+    cluster_extent ext;
+
+    if (!extents.empty() && extents.back().start + extents.back().length == cluster)
+    {
+        extents.back().length++;
+        return;
+    }
+
+    ext.start = cluster;
+    ext.length = 1;
+    extents.push_back(ext);
+}
+
+uint32_t fat_partition::_chain_length(uint32_t index)
+{
+    uint32_t length = 0;
+    size_t e;
+
+    for (e = 0; e < rootdir_extents[index].size(); e++)
+        length += rootdir_extents[index][e].length;
+
+    return length;
+}
+
+void fat_partition::_recache_chains()
+{
+    uint32_t i, j;
+
     for (i = 0; i < bootrec->root_directory_max_entries_count; i++)
     {
-        // go from first cluster
-        j = rootdir[i].first_cluster;
+        rootdir_extents[i].clear();
 
-        // and one-by-one push used clusters to cached structure (this will i.e. preserve cache locality in future search)
+        // go from first cluster and merge consecutive clusters to extents
+        j = rootdir[i].first_cluster;
         do
         {
-            rootdir_cluster_chains[i].push_back(j);
+            _append_extent(rootdir_extents[i], j);
             j = fat_tables[0][j];
         } while (j != FAT_FILE_END);
     }
@@ -167,11 +545,12 @@ const char outputFileLetters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrst
 
 void fat_partition::dump_contents()
 {
+    profile_phase phase("dump");
     int i, j;
-    uint32_t k;
+    uint32_t k, cl;
+    size_t e;
     char fileChar[2] = {0,0};
     int useNum;
-    uint32_t currcluster;
     std::map<int, std::string> fileMap;
 
     int spacing = 1;
@@ -185,20 +564,13 @@ void fat_partition::dump_contents()
         else
             fileChar[0] = '?';
 
-        currcluster = rootdir[i].first_cluster;
-
-        while (true)
+        // cached extents are kept up to date by defragmentation, so FAT does not need to be walked
+        for (e = 0; e < rootdir_extents[i].size(); e++)
         {
-            fileMap[currcluster] = std::string(fileChar) + std::to_string(useNum++);
-
-            if (currcluster == FAT_FILE_END)
-                break;
-
-            currcluster = fat_tables[0][currcluster];
+            for (cl = rootdir_extents[i][e].start; cl < rootdir_extents[i][e].start + rootdir_extents[i][e].length; cl++)
+                fileMap[cl] = std::string(fileChar) + std::to_string(useNum++);
         }
 
-        useNum--;
-
         if (1 + useNum / 10 >= spacing)
             spacing = 2 + useNum / 10; // 1 = implicit spacing, 1 = offset (0 means 1 letter, 1 means 2 letters, etc.)
     }
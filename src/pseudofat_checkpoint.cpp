@@ -0,0 +1,152 @@
+#include "global.h"
+#include "pseudofat.h"
+
+bool fat_partition::load_checkpoint(const char* filename)
+{
+    defrag_checkpoint header;
+    uint32_t i, cnt;
+    uint32_t* first_clusters;
+    uint32_t* queue;
+
+    FILE* f = fopen(filename, "rb");
+
+    // no checkpoint, nothing to resume
+    if (!f)
+        return false;
+
+    cout << "Reading defragmentation checkpoint " << filename << "..." << endl;
+
+    if (fread(&header, sizeof(defrag_checkpoint), 1, f) != 1
+        || strncmp(header.signature, DEFRAG_CHECKPOINT_SIGNATURE, FAT_SIGNATURE_SIZE) != 0
+        || header.cluster_count != bootrec->cluster_count
+        || header.root_directory_max_entries_count != bootrec->root_directory_max_entries_count
+        || header.queue_length > bootrec->cluster_count)
+    {
+        cerr << "Checkpoint does not belong to this filesystem, ignoring it" << endl;
+        fclose(f);
+        return false;
+    }
+
+    cnt = (uint32_t)header.root_directory_max_entries_count;
+    first_clusters = new uint32_t[cnt];
+    file_base_offsets = new uint32_t[cnt];
+    queue = new uint32_t[header.queue_length];
+
+    if (fread(first_clusters, sizeof(uint32_t), cnt, f) != cnt
+        || fread(file_base_offsets, sizeof(uint32_t), cnt, f) != cnt
+        || fread(queue, sizeof(uint32_t), header.queue_length, f) != header.queue_length)
+    {
+        cerr << "Checkpoint is truncated, ignoring it" << endl;
+        fclose(f);
+        delete[] first_clusters;
+        delete[] file_base_offsets;
+        delete[] queue;
+        file_base_offsets = nullptr;
+        return false;
+    }
+
+    fclose(f);
+
+    // checkpoint has to be made right after this image was saved - files has to begin at the same clusters,
+    // and their blocks has to fit into partition
+    for (i = 0; i < cnt; i++)
+    {
+        if (first_clusters[i] != rootdir[i].first_cluster)
+            break;
+        if (file_base_offsets[i] >= real_cluster_count || _chain_length(i) > real_cluster_count - file_base_offsets[i])
+            break;
+    }
+
+    // and every queued cluster has to be still occupied
+    if (i == cnt)
+    {
+        for (i = 0; i < header.queue_length; i++)
+        {
+            if (queue[i] >= bootrec->cluster_count || _is_cluster_available(queue[i]) || _is_cluster_bad(queue[i]))
+                break;
+        }
+        i = (i == header.queue_length) ? cnt : 0;
+    }
+
+    delete[] first_clusters;
+
+    if (i != cnt)
+    {
+        cerr << "Checkpoint does not match filesystem contents, ignoring it" << endl;
+        delete[] file_base_offsets;
+        delete[] queue;
+        file_base_offsets = nullptr;
+        return false;
+    }
+
+    // resume with remaining work only
+    occupied_clusters_to_work.clear();
+    for (i = 0; i < header.queue_length; i++)
+        occupied_clusters_to_work.push_back(queue[i]);
+
+    delete[] queue;
+
+    checkpoint_loaded = true;
+
+    cout << "Resuming defragmentation, " << header.queue_length << " clusters remains to be processed" << endl;
+
+    return true;
+}
+
+bool fat_partition::save_checkpoint(const char* filename)
+{
+    defrag_checkpoint header;
+    uint32_t i;
+    uint32_t cl;
+
+    FILE* f = fopen(filename, "wb");
+
+    if (!f)
+    {
+        cerr << "Failed to open file " << filename << " for writing. Please, check permissions." << endl;
+        return false;
+    }
+
+    cout << "Writing defragmentation checkpoint " << filename << "..." << endl;
+
+    memset(&header, 0, sizeof(defrag_checkpoint));
+    memcpy(header.signature, DEFRAG_CHECKPOINT_SIGNATURE, std::min(strlen(DEFRAG_CHECKPOINT_SIGNATURE), (size_t)FAT_SIGNATURE_SIZE));
+    header.cluster_count = bootrec->cluster_count;
+    header.root_directory_max_entries_count = bootrec->root_directory_max_entries_count;
+    header.queue_length = (uint32_t)occupied_clusters_to_work.size();
+
+    if (fwrite(&header, sizeof(defrag_checkpoint), 1, f) != 1)
+    {
+        fclose(f);
+        return false;
+    }
+
+    for (i = 0; i < bootrec->root_directory_max_entries_count; i++)
+    {
+        if (fwrite(&rootdir[i].first_cluster, sizeof(uint32_t), 1, f) != 1)
+        {
+            fclose(f);
+            return false;
+        }
+    }
+
+    if (fwrite(file_base_offsets, sizeof(uint32_t), (uint32_t)bootrec->root_directory_max_entries_count, f) != (uint32_t)bootrec->root_directory_max_entries_count)
+    {
+        fclose(f);
+        return false;
+    }
+
+    for (i = 0; i < header.queue_length; i++)
+    {
+        cl = occupied_clusters_to_work[i];
+        if (fwrite(&cl, sizeof(uint32_t), 1, f) != 1)
+        {
+            fclose(f);
+            return false;
+        }
+    }
+
+    fclose(f);
+
+    return true;
+}
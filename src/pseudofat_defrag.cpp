@@ -1,5 +1,16 @@
 #include "global.h"
 #include "pseudofat.h"
+#include "profiler.h"
+#include "fileio.h"
+
+// current time in nanoseconds for statistics; clock is not read at all, when statistics are not printed
+static uint64_t stats_clock()
+{
+    if (stats_output == STATS_OUTPUT_NONE)
+        return 0;
+
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 bool fat_partition::_is_cluster_available(uint32_t id)
 {
@@ -11,88 +22,169 @@ bool fat_partition::_is_cluster_bad(uint32_t id)
     return fat_tables[0][id] == FAT_BAD_CLUSTER;
 }
 
+bool fat_partition::_is_cluster_fixed(uint32_t id)
+{
+    return _is_cluster_bad(id) || (id < real_cluster_count && lost_bitmap.test(id));
+}
+
 uint32_t fat_partition::find_free_cluster_begin()
+{
+    uint32_t i = free_bitmap.find_first();
+
+    return (i == BITMAP_NOT_FOUND) ? FAT_UNUSED_NOT_FOUND : i;
+}
+
+uint32_t fat_partition::_find_free_cluster_end(int32_t end_offset)
+{
+    uint32_t i = free_bitmap.find_last(real_cluster_count - end_offset);
+
+    return (i == BITMAP_NOT_FOUND) ? FAT_UNUSED_NOT_FOUND : i;
+}
+
+bool fat_partition::_clusters_in_file()
+{
+    return cluster_mode == CLUSTER_MODE_DISK;
+}
+
+bool fat_partition::_read_cluster_data(uint32_t index, uint8_t* buffer, uint32_t count)
 {
     uint32_t i;
 
-    // go through clusters and find first unused
-    for (i = 0; i < real_cluster_count; i++)
+    if (!file_pread(image_fd, buffer, (size_t)count * bootrec->cluster_size, cluster_region_offset + (int64_t)index * bootrec->cluster_size))
+        return false;
+
+    // clusters may have been written in this round, and they are not in image yet
+    std::unique_lock<std::mutex> lock(pending_mtx);
+
+    if (pending_clusters.empty())
+        return true;
+
+    for (i = 0; i < count; i++)
     {
-        if (fat_tables[0][i] == FAT_UNUSED)
-            return i;
+        std::unordered_map<uint32_t, size_t>::iterator itr = pending_clusters.find(index + i);
+        if (itr != pending_clusters.end())
+            memcpy(buffer + (size_t)i * bootrec->cluster_size, pending_data.data() + itr->second, bootrec->cluster_size);
     }
 
-    return FAT_UNUSED_NOT_FOUND;
+    return true;
 }
 
-uint32_t fat_partition::_find_free_cluster_end(int32_t end_offset)
+bool fat_partition::_write_cluster_data(uint32_t index, const uint8_t* buffer, uint32_t count)
 {
     uint32_t i;
 
-    // we use offset due to counter marked as "unsigned"
-    // when we reach 0, we need to have 0 tested, and then return
-    // this is far the simpliest solution (arithmetic operations
-    // like addition are way faster than branching)
+    // image is not touched until the round is committed through journal
+    std::unique_lock<std::mutex> lock(pending_mtx);
 
-    for (i = real_cluster_count - end_offset; i > 0; i--)
+    for (i = 0; i < count; i++)
     {
-        if (fat_tables[0][i-1] == FAT_UNUSED)
-            return i-1;
+        std::unordered_map<uint32_t, size_t>::iterator itr = pending_clusters.find(index + i);
+        if (itr == pending_clusters.end())
+        {
+            itr = pending_clusters.insert(std::make_pair(index + i, pending_data.size())).first;
+            pending_data.resize(pending_data.size() + bootrec->cluster_size);
+        }
+        memcpy(pending_data.data() + itr->second, buffer + (size_t)i * bootrec->cluster_size, bootrec->cluster_size);
+
+        _mark_cluster_dirty(index + i);
     }
 
-    return FAT_UNUSED_NOT_FOUND;
+    return true;
 }
 
-bool fat_partition::_move_cluster(uint32_t source, uint32_t dest, int32_t thread_id)
+void fat_partition::_transfer_cluster(uint32_t source, uint32_t dest, uint32_t count)
 {
-    uint32_t i;
+    uint32_t i, slot;
+
+    if (_clusters_in_file())
+    {
+        // every thread needs its own buffer, the whole run is copied by single read and write
+        static thread_local std::vector<uint8_t> buffer;
+        buffer.resize((size_t)count * bootrec->cluster_size);
+
+        if (!_read_cluster_data(source, buffer.data(), count) || !_write_cluster_data(dest, buffer.data(), count))
+        {
+            cerr << "Failed to move clusters " << source << " - " << (source + count - 1) << " to " << dest << " in image file" << endl;
+            cluster_io_failed = true;
+        }
+        return;
+    }
+
+    // in memory, swapping slots is enough
+    for (i = 0; i < count; i++)
+    {
+        slot = cluster_slots[source + i];
+        cluster_slots[source + i] = cluster_slots[dest + i];
+        cluster_slots[dest + i] = slot;
+
+        _mark_cluster_dirty(source + i);
+        _mark_cluster_dirty(dest + i);
+    }
+}
+
+bool fat_partition::_move_cluster(uint32_t source, uint32_t dest, uint32_t count, int32_t thread_id)
+{
+    uint32_t pred, next, i;
     int32_t j;
 
     if (verbose_output)
     {
         if (thread_id >= 0)
             cout << "Thread " << thread_id << ": ";
-        cout << "Moving cluster " << source << " to " << dest << endl;
+        if (count == 1)
+            cout << "Moving cluster " << source << " to " << dest << endl;
+        else
+            cout << "Moving clusters " << source << " - " << (source + count - 1) << " to " << dest << " - " << (dest + count - 1) << endl;
     }
 
-    // find FAT entry referencing source cluster, and make it point to relocated one
-    for (i = 0; i < real_cluster_count; i++)
+    pred = cluster_predecessors[source];
+    next = fat_tables[0][source + count - 1];
+
+    // if the source cluster was the beginning of FAT entry chain, relocate it in root directory entry,
+    // otherwise make FAT entry referencing source cluster point to relocated one
+    if (pred != FAT_PREDECESSOR_NONE)
     {
-        if (fat_tables[0][i] == source)
+        if (pred & FAT_PREDECESSOR_ROOTDIR)
+        {
+            rootdir[pred & ~FAT_PREDECESSOR_ROOTDIR].first_cluster = dest;
+            _mark_rootdir_dirty(pred & ~FAT_PREDECESSOR_ROOTDIR);
+        }
+        else
         {
             for (j = 0; j < bootrec->fat_copies; j++)
-            {
-                // point to relocated cluster
-                fat_tables[j][i] = dest;
-            }
-
-            break;
+                fat_tables[j][pred] = dest;
+            _mark_fat_dirty(pred);
         }
     }
 
     // physically move data
-    uint8_t* ptr = clusters[source];
-    clusters[source] = clusters[dest];
-    clusters[dest] = ptr;
+    _transfer_cluster(source, dest, count);
 
-    // mark source cluster as unused in all FAT tables, and rechain original chain
+    // mark source clusters as unused in all FAT tables, and rechain original chain
     for (j = 0; j < bootrec->fat_copies; j++)
     {
-        // move reference in all fat tables
-        fat_tables[j][dest] = fat_tables[j][source];
-        fat_tables[j][source] = FAT_UNUSED;
+        // links inside of run points to following destination, the last one keeps original reference
+        for (i = 0; i < count; i++)
+        {
+            fat_tables[j][dest + i] = (i + 1 < count) ? dest + i + 1 : fat_tables[j][source + i];
+            fat_tables[j][source + i] = FAT_UNUSED;
+        }
     }
 
-    // if the source cluster was the beginning of FAT entry chain, relocate it also
-    // in root directory entry
-    for (i = 0; i < bootrec->root_directory_max_entries_count; i++)
+    for (i = 0; i < count; i++)
     {
-        if (rootdir[i].first_cluster == source)
-        {
-            rootdir[i].first_cluster = dest;
-            break;
-        }
+        _mark_fat_dirty(source + i);
+        _mark_fat_dirty(dest + i);
+
+        free_bitmap.clear(dest + i);
+        free_bitmap.set(source + i);
+
+        // update reverse links
+        cluster_predecessors[dest + i] = (i == 0) ? pred : dest + i - 1;
+        cluster_predecessors[source + i] = FAT_PREDECESSOR_NONE;
     }
+    if (next != FAT_FILE_END && next < bootrec->cluster_count)
+        cluster_predecessors[next] = dest + count - 1;
 
     // just for debugging purposes
     //std::this_thread::sleep_for(std::chrono::milliseconds(5));
@@ -100,200 +192,1245 @@ bool fat_partition::_move_cluster(uint32_t source, uint32_t dest, int32_t thread
     return true;
 }
 
-uint32_t fat_partition::get_thread_work_cluster(int32_t retback)
+uint32_t fat_partition::_cluster_region(uint32_t id)
 {
-    // lock assigning mutex
-    std::unique_lock<std::mutex> lock(assign_mtx);
+    uint32_t region = id / region_size;
+
+    // everything behind the last target belongs to the last region
+    return (region < thread_count) ? region : thread_count - 1;
+}
 
-    // if we are returning something back...
-    if (retback >= 0)
-        occupied_clusters_to_work.push_back(retback);
+void fat_partition::_lock_regions(uint32_t regions, uint32_t thread_id)
+{
+    uint32_t i;
+    uint64_t wait_start = stats_clock();
 
-    // if nothing to proceed, quit
-    if (occupied_clusters_to_work.empty())
-        return FAT_UNUSED_NOT_FOUND;
+    // lock regions always in ascending order to avoid deadlocks
+    for (i = 0; i < thread_count; i++)
+    {
+        if (regions & (1U << i))
+            region_mutexes[i].lock();
+    }
 
-    // get first available cluster to be processed
-    uint32_t toret = occupied_clusters_to_work.front();
+    defrag_stats[thread_id].region_wait_ns += stats_clock() - wait_start;
+}
 
-    // remove from queue
-    occupied_clusters_to_work.pop_front();
+void fat_partition::_unlock_regions(uint32_t regions)
+{
+    uint32_t i;
 
-    return toret;
+    for (i = thread_count; i > 0; i--)
+    {
+        if (regions & (1U << (i - 1)))
+            region_mutexes[i - 1].unlock();
+    }
 }
 
-void fat_partition::put_thread_work_cluster(int32_t retback)
+uint32_t fat_partition::_move_cluster_run(uint32_t source, uint32_t dest, uint32_t thread_id, bool extend_run)
 {
-    // lock assignment mutex
-    std::unique_lock<std::mutex> lock(assign_mtx);
+    uint32_t pred, next, i, count, taken, needed;
+    defrag_thread_stats& stats = defrag_stats[thread_id];
+
+    // links of source and free state of destination are written only under lock of their region, so they are read
+    // under it too; there are at most 16 threads, so set of regions fits in bit mask
+    uint32_t regions = (1U << _cluster_region(source)) | (1U << _cluster_region(dest));
+
+    _lock_regions(regions, thread_id);
+
+    // run is extended only inside of locked regions
+    count = 1;
+    if (extend_run)
+    {
+        count = _claim_cluster_run(source, dest, thread_id, regions);
+        taken = _consume_defrag_budget(count);
+
+        // the rest of run, that does not fit into budget, stays for the next run
+        for (i = taken; i < count; i++)
+            cluster_claims[source + i] = 0;
+
+        count = taken;
+        if (count == 0)
+        {
+            _unlock_regions(regions);
+            return 0;
+        }
+    }
+
+    // move touches both neighbours in chain too; when they are in another region, lock it as well
+    // and look at them again, as they could have been moved before we got the locks
+    while (true)
+    {
+        pred = cluster_predecessors[source];
+        next = fat_tables[0][source + count - 1];
+
+        needed = regions;
+        if (pred != FAT_PREDECESSOR_NONE && !(pred & FAT_PREDECESSOR_ROOTDIR))
+            needed |= 1U << _cluster_region(pred);
+        if (next != FAT_FILE_END && next < bootrec->cluster_count)
+            needed |= 1U << _cluster_region(next);
+
+        if (needed == regions)
+            break;
+
+        _unlock_regions(regions);
+        stats.retries++;
+        regions = needed;
+        _lock_regions(regions, thread_id);
+    }
+
+    _move_cluster(source, dest, count, thread_id);
 
-    // just put back the cluster
-    occupied_clusters_to_work.push_back(retback);
+    _unlock_regions(regions);
+
+    stats.moves++;
+    stats.clusters += count;
+
+    return count;
 }
 
-bool fat_partition::get_thread_work_cluster_reserve(uint32_t entry)
+uint32_t fat_partition::_claim_cluster_run(uint32_t source, uint32_t dest, uint32_t thread_id, uint32_t regions)
 {
-    // lock assignment mutex
-    std::unique_lock<std::mutex> lock(assign_mtx);
+    uint32_t count = 1, cl;
+    uint32_t max_count = MOVE_RUN_MAX_SIZE / bootrec->cluster_size;
 
-    // check, if there is still that cluster in non-processed queue
-    for (auto itr = occupied_clusters_to_work.begin(); itr != occupied_clusters_to_work.end(); ++itr)
+    // following cluster has to be the next one in chain, with the next target, which has to be free;
+    // links inside of claimed run can't change, as only move of their clusters would change them
+    while (count < max_count)
     {
-        // if cluster was found, erase it and report success
-        if (*itr == entry)
+        cl = source + count;
+        if (cl >= bootrec->cluster_count || dest + count >= real_cluster_count)
+            break;
+        if (!(regions & (1U << _cluster_region(cl))) || !(regions & (1U << _cluster_region(dest + count))))
+            break;
+        if (fat_tables[0][cl - 1] != cl || cluster_targets[cl] != dest + count || !_is_cluster_available(dest + count))
+            break;
+        if (!get_thread_work_cluster_reserve(cl))
         {
-            itr = occupied_clusters_to_work.erase(itr);
-            return true;
+            defrag_stats[thread_id].reserve_failures++;
+            break;
         }
+
+        count++;
     }
 
-    // cluster was assigned to another thread
-    return false;
+    return count;
 }
 
-uint32_t fat_partition::get_aligned_position(uint32_t current)
+bool fat_partition::get_thread_work_cluster_reserve(uint32_t entry)
 {
-    uint32_t i, j;
+    uint8_t expected = 0;
+
+    // cluster stays in its queue and is dropped when someone takes it from there;
+    // fails, when cluster was assigned to another thread
+    return cluster_claims[entry].compare_exchange_strong(expected, 1);
+}
+
+void fat_partition::build_cluster_targets()
+{
+    uint32_t i, cl, pos;
+    size_t e;
+
+    // clusters outside of any chain stays where they are
+    cluster_targets = new uint32_t[bootrec->cluster_count];
+    for (i = 0; i < bootrec->cluster_count; i++)
+        cluster_targets[i] = i;
 
     // look for all root directory entries
     for (i = 0; i < bootrec->root_directory_max_entries_count; i++)
     {
-        // and go through all chains
-        for (j = 0; j < rootdir_cluster_chains[i].size(); j++)
+        pos = file_base_offsets[i];
+
+        // and assign consecutive positions to whole chain
+        for (e = 0; e < rootdir_extents[i].size(); e++)
         {
-            // find current cluster
-            if (rootdir_cluster_chains[i][j] == current)
+            for (cl = rootdir_extents[i][e].start; cl < rootdir_extents[i][e].start + rootdir_extents[i][e].length; cl++)
             {
-                // skip bad clusters
-                while (_is_cluster_bad(file_base_offsets[i] + j))
-                    j++;
+                // skip bad and lost clusters
+                while (pos < bootrec->cluster_count && _is_cluster_fixed(pos))
+                    pos++;
+
+                cluster_targets[cl] = pos++;
+            }
+        }
+    }
+}
+
+uint32_t fat_partition::get_aligned_position(uint32_t current)
+{
+    return cluster_targets[current];
+}
+
+uint32_t fat_partition::get_thread_work_cluster(uint32_t threadid)
+{
+    uint32_t i, toret;
+    defrag_work_queue* queue;
 
-                // return correct aligned position
-                return file_base_offsets[i] + j;
+    // look to own queue first, then try to steal from others
+    for (i = 0; i < thread_count && ready_count > 0; i++)
+    {
+        queue = &thread_work_queues[(threadid + i) % thread_count];
+
+        std::unique_lock<std::mutex> lock(queue->mtx);
+
+        while (!queue->clusters.empty())
+        {
+            // owner goes from front, thieves from back, so they don't fight for the same end
+            if (i == 0)
+            {
+                toret = queue->clusters.front();
+                queue->clusters.pop_front();
+            }
+            else
+            {
+                toret = queue->clusters.back();
+                queue->clusters.pop_back();
             }
+            ready_count--;
+
+            // cluster may have been moved as a part of another run - just drop it
+            if (get_thread_work_cluster_reserve(toret))
+                return toret;
+
+            defrag_stats[threadid].reserve_failures++;
         }
     }
 
-    // not found, sorry
-    return (uint32_t)(-1);
+    // nothing to proceed
+    return FAT_PREDECESSOR_NONE;
+}
+
+void fat_partition::put_thread_work_cluster(uint32_t entry)
+{
+    // cluster goes to the thread owning region of its target, which is free now
+    defrag_work_queue* queue = &thread_work_queues[_cluster_region(cluster_targets[entry])];
+
+    std::unique_lock<std::mutex> lock(queue->mtx);
+
+    queue->clusters.push_back(entry);
+    ready_count++;
 }
 
 void fat_partition::thread_process(uint32_t threadid)
 {
-    uint32_t entry, dest;
-    int32_t toret = -1;
+    uint32_t entry, taken, i, waiting, released;
+    uint64_t wait_start;
+    defrag_thread_stats& stats = defrag_stats[threadid];
+
+    std::unique_lock<std::mutex> lock(ready_mtx, std::defer_lock);
 
     // defrag loop
     while (true)
     {
-        // if there isn't something to retry
-        if (toret == -1)
+        // worker counts as active before it looks for work, so nobody considers the round quiet in the meantime
+        active_workers++;
+
+        entry = defrag_budget_exhausted ? FAT_PREDECESSOR_NONE : get_thread_work_cluster(threadid);
+        if (entry != FAT_PREDECESSOR_NONE)
         {
-            // retrieve work from farmer
-            entry = get_thread_work_cluster(toret);
-            // if no such work, return
-            if (entry == FAT_UNUSED_NOT_FOUND)
-                break;
+            // move clusters to the right place (it's free and nobody else targets it),
+            // clusters following in chain and in targets are moved together
+            taken = _move_cluster_run(entry, get_aligned_position(entry), threadid, true);
+
+            // vacated positions let clusters waiting for them go
+            released = 0;
+            for (i = 0; i < taken; i++)
+            {
+                waiting = move_dependents[entry + i];
+                if (waiting != FAT_PREDECESSOR_NONE)
+                {
+                    put_thread_work_cluster(waiting);
+                    released++;
+                }
+            }
+
+            // global lock is needed only to wake idle workers - for new work, or to break a cycle, when nobody moves anything
+            if ((active_workers.fetch_sub(1) == 1 || released > 0) && idle_workers > 0)
+            {
+                lock.lock();
+                ready_cv.notify_all();
+                lock.unlock();
+            }
+            continue;
         }
-        else // work on self-assigned cluster
-            entry = toret;
 
-        toret = -1;
+        active_workers--;
+
+        // nothing is ready - wait for other workers
+        wait_start = stats_clock();
+        lock.lock();
+        idle_workers++;
+        while (ready_count == 0 && active_workers > 0 && !defrag_budget_exhausted && !defrag_round_done)
+        {
+            stats.waits++;
+            ready_cv.wait(lock);
+        }
+        idle_workers--;
+        stats.queue_wait_ns += stats_clock() - wait_start;
 
-        // retrieve correct position
-        dest = get_aligned_position(entry);
+        // all done (or budget is exhausted) - let other waiting workers know
+        if (defrag_budget_exhausted || defrag_round_done)
+        {
+            ready_cv.notify_all();
+            break;
+        }
 
-        // and if the cluster is not on its place...
-        if (entry != dest)
+        // when nobody moves anything, only cycles remains
+        if (ready_count == 0 && active_workers == 0 && !_break_move_cycle(threadid))
         {
-            // if the destination cluster is available, we are free to go
-            if (_is_cluster_available(dest))
-            {
-                if (verbose_output)
-                    cout << "Thread " << threadid << ": moving " << entry << " to " << dest << endl;
+            defrag_round_done = true;
+            ready_cv.notify_all();
+            break;
+        }
 
-                // lock move mutex
-                std::unique_lock<std::mutex> lck(move_mtx);
+        lock.unlock();
+    }
+}
 
-                // move cluster to the right place
-                _move_cluster(entry, dest, threadid);
-            }
-            else
-            {
-                toret = entry;
+bool fat_partition::_break_move_cycle(uint32_t thread_id)
+{
+    uint32_t cl, scratch;
 
-                // if some thread already got it, try it again
-                if (!get_thread_work_cluster_reserve(dest))
-                {
-                    // give our time to others for this turn, gives us chance, that other thread will finish that cluster
-                    std::this_thread::yield();
-                    continue;
-                }
+    // every cluster, that was not claimed yet, waits for another one in a cycle
+    while (cycle_scan_pos < round_clusters.size() && cluster_claims[round_clusters[cycle_scan_pos]] != 0)
+        cycle_scan_pos++;
 
-                if (verbose_output)
-                    cout << "Thread " << threadid << ": returning: " << entry << ", retaking: " << dest << endl;
+    if (cycle_scan_pos == round_clusters.size())
+        return false;
 
-                // return entry back
-                put_thread_work_cluster(entry);
+    cl = round_clusters[cycle_scan_pos];
 
-                // process cluster, that stands in our way
-                toret = dest;
-            }
-        }
+    // nobody targets free clusters now, otherwise their clusters would be ready
+    scratch = _find_free_cluster_end();
+    if (scratch == FAT_UNUSED_NOT_FOUND || !get_thread_work_cluster_reserve(cl))
+        return false;
+
+    if (_consume_defrag_budget(1) == 0)
+    {
+        cluster_claims[cl] = 0;
+        return false;
     }
+
+    if (verbose_output)
+        cout << "Thread " << thread_id << ": breaking cycle, moving " << cl << " aside to " << scratch << endl;
+
+    _move_cluster_run(cl, scratch, thread_id, false);
+    defrag_stats[thread_id].cycle_breaks++;
+
+    // moved cluster keeps its target and waits for it at new position
+    cluster_targets[scratch] = cluster_targets[cl];
+    move_dependents[cluster_targets[cl]] = scratch;
+    cluster_claims[scratch] = 0;
+    round_clusters.push_back(scratch);
+
+    // and its original position lets the rest of cycle go
+    if (move_dependents[cl] != FAT_PREDECESSOR_NONE)
+        put_thread_work_cluster(move_dependents[cl]);
+
+    return true;
 }
 
-void defrag_thread_fnc(fat_partition* partition, uint32_t thread_id)
+uint32_t fat_partition::_consume_defrag_budget(uint32_t count)
 {
-    partition->thread_process(thread_id);
+    uint32_t taken;
+
+    if (defrag_time_budget > 0 && std::chrono::steady_clock::now() >= defrag_deadline)
+    {
+        defrag_budget_exhausted = true;
+        return 0;
+    }
+
+    if (move_budget_limit == 0)
+        return count;
+
+    taken = defrag_moves_taken.fetch_add(count);
+    if (taken >= move_budget_limit)
+    {
+        defrag_budget_exhausted = true;
+        return 0;
+    }
+
+    // only part of requested moves fits into budget
+    if (taken + count > move_budget_limit)
+    {
+        defrag_budget_exhausted = true;
+        return move_budget_limit - taken;
+    }
+
+    return count;
 }
 
-bool fat_partition::defragment()
+bool fat_partition::is_defrag_incomplete()
 {
-    uint32_t i, tmp;
-    free_space_size = real_cluster_count / MIN_DEFRAG_FREE_FRACTION;
-    // check free space - there should be at least minimum fraction of free space
-    if (free_clusters_count < free_space_size)
+    return defrag_incomplete;
+}
+
+void fat_partition::cycle_thread_process(uint32_t threadid)
+{
+    uint32_t index, count;
+
+    // chains are independent, so just take next one until there's nothing left
+    while ((index = move_chain_next++) < move_chains.size())
     {
-        cout << "Not enough free space for defragmentation, please, make sure at least " << round(100.0f/(float)MIN_DEFRAG_FREE_FRACTION) << "% of disk is free" << endl;
-        return false;
+        defrag_move_chain& chain = move_chains[index];
+
+        count = _consume_defrag_budget((uint32_t)chain.clusters.size() + (chain.cycle ? 1 : 0));
+        if (count == 0)
+            break;
+
+        // cycle can't be stopped in the middle, chain can
+        if (chain.cycle || count > chain.clusters.size())
+            count = (uint32_t)chain.clusters.size();
+
+        _rotate_move_chain(chain, count, threadid);
+        chain.moved = count;
+
+        defrag_stats[threadid].moves++;
+        defrag_stats[threadid].clusters += count;
     }
+}
 
-    cout << "Defragmenting..." << endl << endl;
+bool fat_partition::_plan_move_chains()
+{
+    uint32_t i, cl, first, dest, scratch;
+    size_t e;
+    uint32_t moves = 0, cycles = 0;
+    defrag_move_chain chain;
 
-    // cache file cluster count - this is the resulting size of file block
-    uint32_t currBase = 0, oldBase = 0;
-    file_base_offsets = new uint32_t[(uint32_t)bootrec->root_directory_max_entries_count];
+    // incoming[x] is the cluster, that has to be moved to position x
+    uint32_t* incoming = new uint32_t[bootrec->cluster_count];
+    std::vector<bool> visited(bootrec->cluster_count, false);
+
+    for (i = 0; i < bootrec->cluster_count; i++)
+        incoming[i] = FAT_PREDECESSOR_NONE;
+
+    move_chains.clear();
+
+    // every cluster in chain, that is not on its place, has to be moved
     for (i = 0; i < bootrec->root_directory_max_entries_count; i++)
     {
-        file_base_offsets[i] = currBase;
-        oldBase = currBase;
-        currBase += (uint32_t)((rootdir[i].file_size / bootrec->cluster_size)+1);
-
-        // skip bad clusters - move next file_base offsets
-        for (tmp = oldBase; tmp < currBase; tmp++)
+        for (e = 0; e < rootdir_extents[i].size(); e++)
         {
-            if (_is_cluster_bad(tmp))
-                currBase++;
+            const cluster_extent& ext = rootdir_extents[i][e];
+
+            // targets of file are ascending, so extent with both ends on their place does not move at all
+            if (cluster_targets[ext.start] == ext.start && cluster_targets[ext.start + ext.length - 1] == ext.start + ext.length - 1)
+                continue;
+
+            for (cl = ext.start; cl < ext.start + ext.length; cl++)
+            {
+                dest = cluster_targets[cl];
+                if (cl == dest)
+                    continue;
+
+                if (dest >= real_cluster_count)
+                {
+                    cout << "Not enough space for defragmentation, files does not fit into partition" << endl;
+                    delete[] incoming;
+                    return false;
+                }
+
+                // destination is occupied by cluster, that is not going to move anywhere
+                if (!_is_cluster_available(dest) && cluster_targets[dest] == dest)
+                {
+                    cout << "Cluster " << dest << " is occupied by cluster outside of any file, could not proceed" << endl;
+                    delete[] incoming;
+                    return false;
+                }
+
+                // every position can be target of one cluster only
+                if (incoming[dest] != FAT_PREDECESSOR_NONE)
+                {
+                    cout << "Clusters " << incoming[dest] << " and " << cl << " have the same target " << dest << ", could not proceed" << endl;
+                    delete[] incoming;
+                    return false;
+                }
+
+                incoming[dest] = cl;
+            }
         }
     }
 
-    // create worker pool
-    std::thread** workers = new std::thread*[thread_count];
-    // create worker threads
-    for (i = 0; i < thread_count; i++)
-        workers[i] = new std::thread(defrag_thread_fnc, this, i);
-
-    // join every thread, and when it's dead, delete it
-    for (i = 0; i < thread_count; i++)
+    // chains - begin with clusters, which target is free; every move then frees target of next cluster
+    for (i = 0; i < bootrec->root_directory_max_entries_count; i++)
     {
-        workers[i]->join();
-        delete workers[i];
+        for (e = 0; e < rootdir_extents[i].size(); e++)
+        {
+            const cluster_extent& ext = rootdir_extents[i][e];
+
+            for (first = ext.start; first < ext.start + ext.length; first++)
+            {
+                if (first == cluster_targets[first] || !_is_cluster_available(cluster_targets[first]))
+                    continue;
+
+                chain.cycle = false;
+                chain.moved = 0;
+                chain.clusters.clear();
+
+                for (cl = first; cl != FAT_PREDECESSOR_NONE; cl = incoming[cl])
+                {
+                    chain.clusters.push_back(cl);
+                    visited[cl] = true;
+                }
+
+                moves += (uint32_t)chain.clusters.size();
+                move_chains.push_back(chain);
+            }
+        }
     }
 
-    // cleanup
-    delete[] workers;
+    // everything else has to be in cycles
+    for (i = 0; i < bootrec->root_directory_max_entries_count; i++)
+    {
+        for (e = 0; e < rootdir_extents[i].size(); e++)
+        {
+            const cluster_extent& ext = rootdir_extents[i][e];
+
+            for (first = ext.start; first < ext.start + ext.length; first++)
+            {
+                if (first == cluster_targets[first] || visited[first])
+                    continue;
+
+                chain.cycle = true;
+                chain.moved = 0;
+                chain.clusters.clear();
+
+                cl = first;
+                do
+                {
+                    chain.clusters.push_back(cl);
+                    visited[cl] = true;
+                    cl = incoming[cl];
+                } while (cl != first);
+
+                // moves in image file are kept in memory until the round is committed, and cycle can't be stopped in the middle;
+                // so cycle, that does not fit into round, has its first cluster moved aside to free cluster, that nobody targets,
+                // and the rest is a chain
+                if (_clusters_in_file() && move_budget_limit > 0 && chain.clusters.size() + 1 > move_budget_limit)
+                {
+                    scratch = _find_free_cluster_end();
+                    while (scratch != FAT_UNUSED_NOT_FOUND && incoming[scratch] != FAT_PREDECESSOR_NONE)
+                        scratch = _find_free_cluster_end(real_cluster_count - scratch);
+
+                    if (scratch != FAT_UNUSED_NOT_FOUND)
+                    {
+                        cluster_targets[first] = scratch;
+                        incoming[scratch] = first;
+                        chain.cycle = false;
+                    }
+                }
+
+                // one more move through scratch slot
+                moves += (uint32_t)chain.clusters.size() + (chain.cycle ? 1 : 0);
+                if (chain.cycle)
+                    cycles++;
+                move_chains.push_back(chain);
+            }
+        }
+    }
+
+    delete[] incoming;
+
+    cout << "Planned " << moves << " cluster moves in " << move_chains.size() << " chains (" << cycles << " cycles)" << endl;
+
+    return true;
+}
+
+void fat_partition::_rotate_move_chain(const defrag_move_chain& chain, uint32_t count, uint32_t thread_id)
+{
+    size_t i;
+    uint32_t dest, scratch;
+
+    if (verbose_output)
+        cout << "Thread " << thread_id << ": " << (chain.cycle ? "rotating cycle" : "moving chain") << " of " << chain.clusters.size() << " clusters at " << chain.clusters[0] << endl;
+
+    if (!chain.cycle)
+    {
+        // target of the first cluster is free, and every move frees target of the next one
+        for (i = 0; i < count; i++)
+        {
+            dest = cluster_targets[chain.clusters[i]];
+            _transfer_cluster(chain.clusters[i], dest);
+        }
+    }
+    else if (_clusters_in_file())
+    {
+        // park first cluster in scratch buffer, shift the rest and write the first one to its place
+        std::vector<uint8_t> buffer(bootrec->cluster_size);
+
+        if (!_read_cluster_data(chain.clusters[0], buffer.data()))
+        {
+            cerr << "Failed to read cluster " << chain.clusters[0] << " from image file" << endl;
+            cluster_io_failed = true;
+            return;
+        }
+
+        for (i = 1; i < chain.clusters.size(); i++)
+            _transfer_cluster(chain.clusters[i], chain.clusters[i - 1]);
+
+        if (!_write_cluster_data(chain.clusters[chain.clusters.size() - 1], buffer.data()))
+        {
+            cerr << "Failed to write cluster " << chain.clusters[chain.clusters.size() - 1] << " to image file" << endl;
+            cluster_io_failed = true;
+        }
+    }
+    else
+    {
+        // park first cluster in scratch slot, shift the rest and put the first one to its place
+        scratch = cluster_slots[chain.clusters[0]];
+        for (i = 1; i < chain.clusters.size(); i++)
+        {
+            cluster_slots[chain.clusters[i - 1]] = cluster_slots[chain.clusters[i]];
+            _mark_cluster_dirty(chain.clusters[i - 1]);
+        }
+        cluster_slots[chain.clusters[chain.clusters.size() - 1]] = scratch;
+        _mark_cluster_dirty(chain.clusters[chain.clusters.size() - 1]);
+    }
+}
+
+void fat_partition::_relink_moved_clusters()
+{
+    uint32_t i, val;
+    int32_t j;
+    size_t e;
+    std::vector<cluster_extent> extents;
+    uint32_t* relinked = new uint32_t[bootrec->cluster_count];
+
+    // relocate reverse links (needs original primary FAT to know, which clusters are occupied)
+    for (i = 0; i < bootrec->cluster_count; i++)
+        relinked[i] = FAT_PREDECESSOR_NONE;
+    for (i = 0; i < bootrec->cluster_count; i++)
+    {
+        if (_is_cluster_available(i) || _is_cluster_bad(i))
+            continue;
+
+        val = cluster_predecessors[i];
+        if (val != FAT_PREDECESSOR_NONE && !(val & FAT_PREDECESSOR_ROOTDIR))
+            val = cluster_targets[val];
+        relinked[cluster_targets[i]] = val;
+    }
+    memcpy(cluster_predecessors, relinked, sizeof(uint32_t) * bootrec->cluster_count);
+
+    // rewrite FAT tables from the last one, so the primary table still holds original state
+    for (j = bootrec->fat_copies - 1; j >= 0; j--)
+    {
+        memcpy(relinked, fat_tables[j], sizeof(uint32_t) * bootrec->cluster_count);
+
+        // vacate all moved clusters
+        for (i = 0; i < bootrec->cluster_count; i++)
+        {
+            if (cluster_targets[i] != i)
+                relinked[i] = FAT_UNUSED;
+        }
+
+        // and put relocated links to their targets
+        for (i = 0; i < bootrec->cluster_count; i++)
+        {
+            if (_is_cluster_available(i) || _is_cluster_bad(i))
+                continue;
+
+            val = fat_tables[j][i];
+            if (val != FAT_FILE_END && val != FAT_UNUSED && val != FAT_BAD_CLUSTER && val < bootrec->cluster_count)
+                val = cluster_targets[val];
+            relinked[cluster_targets[i]] = val;
+        }
+
+        for (i = 0; i < bootrec->cluster_count; i++)
+        {
+            if (relinked[i] != fat_tables[j][i])
+                _mark_fat_dirty(i);
+        }
+
+        memcpy(fat_tables[j], relinked, sizeof(uint32_t) * bootrec->cluster_count);
+    }
+
+    // moved clusters are free now, unless some other cluster was moved to their place
+    for (i = 0; i < bootrec->cluster_count; i++)
+    {
+        if (cluster_targets[i] != i)
+            free_bitmap.set(i);
+    }
+    for (i = 0; i < bootrec->cluster_count; i++)
+    {
+        if (cluster_targets[i] != i)
+            free_bitmap.clear(cluster_targets[i]);
+    }
+
+    // relocate chain beginnings and cached extents
+    for (i = 0; i < bootrec->root_directory_max_entries_count; i++)
+    {
+        if (cluster_targets[rootdir[i].first_cluster] != rootdir[i].first_cluster)
+        {
+            rootdir[i].first_cluster = cluster_targets[rootdir[i].first_cluster];
+            _mark_rootdir_dirty(i);
+        }
+
+        extents.clear();
+        for (e = 0; e < rootdir_extents[i].size(); e++)
+        {
+            for (val = rootdir_extents[i][e].start; val < rootdir_extents[i][e].start + rootdir_extents[i][e].length; val++)
+                _append_extent(extents, cluster_targets[val]);
+        }
+        rootdir_extents[i].swap(extents);
+    }
+
+    delete[] relinked;
+}
+
+void defrag_thread_fnc(fat_partition* partition, uint32_t thread_id)
+{
+    partition->thread_process(thread_id);
+}
+
+void defrag_cycle_thread_fnc(fat_partition* partition, uint32_t thread_id)
+{
+    partition->cycle_thread_process(thread_id);
+}
+
+bool fat_partition::_defragment_queue()
+{
+    uint32_t i, cl, dest, last_target;
+    bool result = true;
+
+    // nothing is claimable except of clusters waiting to be moved
+    cluster_claims = new std::atomic<uint8_t>[bootrec->cluster_count];
+    move_dependents = new uint32_t[bootrec->cluster_count];
+    for (i = 0; i < bootrec->cluster_count; i++)
+    {
+        cluster_claims[i] = 1;
+        move_dependents[i] = FAT_PREDECESSOR_NONE;
+    }
+
+    // split used part of partition to one region per thread
+    last_target = 0;
+    for (i = 0; i < bootrec->cluster_count; i++)
+    {
+        if (cluster_targets[i] > last_target && !_is_cluster_available(i))
+            last_target = cluster_targets[i];
+    }
+    region_size = last_target / thread_count + 1;
+    region_mutexes = new std::mutex[thread_count];
+    thread_work_queues = new defrag_work_queue[thread_count];
+    ready_count = 0;
+
+    // dependency graph - cluster, which target is free, is ready; otherwise it waits for cluster standing on its target
+    round_clusters.clear();
+    for (i = 0; i < occupied_clusters_to_work.size(); i++)
+    {
+        cl = occupied_clusters_to_work[i];
+        dest = cluster_targets[cl];
+        if (cl == dest)
+            continue;
+
+        if (dest >= real_cluster_count)
+        {
+            cout << "Not enough space for defragmentation, files does not fit into partition" << endl;
+            result = false;
+            break;
+        }
+
+        // every position can be target of one cluster only, otherwise the second one would wait forever
+        if (move_dependents[dest] != FAT_PREDECESSOR_NONE)
+        {
+            cout << "Clusters " << move_dependents[dest] << " and " << cl << " have the same target " << dest << ", could not proceed" << endl;
+            result = false;
+            break;
+        }
+
+        if (!_is_cluster_available(dest) && cluster_targets[dest] == dest)
+        {
+            cout << "Cluster " << dest << " is occupied by cluster outside of any file, could not proceed" << endl;
+            result = false;
+            break;
+        }
+
+        cluster_claims[cl] = 0;
+        round_clusters.push_back(cl);
+
+        // free target is never vacated, so its dependent is only kept to detect duplicate targets
+        move_dependents[dest] = cl;
+        if (_is_cluster_available(dest))
+            put_thread_work_cluster(cl);
+    }
+
+    if (result)
+    {
+        occupied_clusters_to_work.clear();
+        active_workers = 0;
+        idle_workers = 0;
+        defrag_round_done = false;
+        cycle_scan_pos = 0;
+
+        // create worker pool
+        std::thread** workers = new std::thread*[thread_count];
+        // create worker threads
+        for (i = 0; i < thread_count; i++)
+            workers[i] = new std::thread(defrag_thread_fnc, this, i);
+
+        // join every thread, and when it's dead, delete it
+        for (i = 0; i < thread_count; i++)
+        {
+            workers[i]->join();
+            delete workers[i];
+        }
+        delete[] workers;
+
+        // collect clusters, that were not processed due to budget
+        for (i = 0; i < round_clusters.size(); i++)
+        {
+            if (cluster_claims[round_clusters[i]] == 0)
+            {
+                cluster_claims[round_clusters[i]] = 1;
+                occupied_clusters_to_work.push_back(round_clusters[i]);
+            }
+        }
+        defrag_incomplete = !occupied_clusters_to_work.empty();
+
+        // workers stopped without running out of budget - there was no free cluster to break the rest of cycles
+        if (defrag_incomplete && !defrag_budget_exhausted)
+        {
+            cout << "No free cluster to break cycle of moves, " << occupied_clusters_to_work.size() << " clusters could not be moved" << endl;
+            result = false;
+        }
+    }
+
+    // cleanup
+    round_clusters.clear();
+    delete[] cluster_claims;
+    delete[] move_dependents;
+    delete[] region_mutexes;
+    delete[] thread_work_queues;
+
+    return result;
+}
+
+bool fat_partition::_defragment_cycles()
+{
+    uint32_t i, j;
+
+    // split permutation of clusters to independent chains and cycles
+    if (!_plan_move_chains())
+        return false;
+
+    move_chain_next = 0;
+
+    // create worker pool
+    std::thread** workers = new std::thread*[thread_count];
+    // create worker threads
+    for (i = 0; i < thread_count; i++)
+        workers[i] = new std::thread(defrag_cycle_thread_fnc, this, i);
+
+    // join every thread, and when it's dead, delete it
+    for (i = 0; i < thread_count; i++)
+    {
+        workers[i]->join();
+        delete workers[i];
+    }
+
+    // cleanup
+    delete[] workers;
+
+    // clusters, that were not moved due to budget, stays where they are and remains in queue
+    occupied_clusters_to_work.clear();
+    for (i = 0; i < move_chains.size(); i++)
+    {
+        for (j = move_chains[i].moved; j < move_chains[i].clusters.size(); j++)
+        {
+            cluster_targets[move_chains[i].clusters[j]] = move_chains[i].clusters[j];
+            occupied_clusters_to_work.push_back(move_chains[i].clusters[j]);
+        }
+    }
+    defrag_incomplete = !occupied_clusters_to_work.empty();
+
+    // all data are at their place, rewrite links in FAT tables
+    _relink_moved_clusters();
+
+    move_chains.clear();
+
+    return true;
+}
+
+bool fat_partition::_compute_file_base_offsets_minimal()
+{
+    uint32_t i, j, pos, len;
+    size_t k;
+    std::vector<bool> anchored(real_cluster_count, false);
+    std::vector<bool> placed((uint32_t)bootrec->root_directory_max_entries_count, false);
+    // gaps between anchored files - beginning and number of usable (not bad nor lost) clusters
+    std::vector<uint32_t> gap_begin, gap_capacity;
+
+    // files, that are already contiguous (bad or lost clusters inbetween does not matter) stays where they are
+    for (i = 0; i < bootrec->root_directory_max_entries_count; i++)
+    {
+        std::vector<cluster_extent>& extents = rootdir_extents[i];
+
+        // only bad or lost clusters may separate extents
+        for (k = 1; k < extents.size(); k++)
+        {
+            pos = extents[k - 1].start + extents[k - 1].length;
+            while (pos < extents[k].start && _is_cluster_fixed(pos))
+                pos++;
+            if (pos != extents[k].start)
+                break;
+        }
+
+        if (k < extents.size() || extents.back().start + extents.back().length > real_cluster_count)
+            continue;
+
+        file_base_offsets[i] = extents[0].start;
+        placed[i] = true;
+        for (k = 0; k < extents.size(); k++)
+        {
+            for (pos = extents[k].start; pos < extents[k].start + extents[k].length; pos++)
+                anchored[pos] = true;
+        }
+    }
+
+    // find all gaps around anchored files
+    for (pos = 0; pos < real_cluster_count; pos++)
+    {
+        if (anchored[pos])
+            continue;
+
+        gap_begin.push_back(pos);
+        gap_capacity.push_back(0);
+        for (; pos < real_cluster_count && !anchored[pos]; pos++)
+        {
+            if (!_is_cluster_fixed(pos))
+                gap_capacity.back()++;
+        }
+    }
+
+    // place the rest of files to the first gap, that fits them
+    for (i = 0; i < bootrec->root_directory_max_entries_count; i++)
+    {
+        if (placed[i])
+            continue;
+
+        len = _chain_length(i);
+        for (k = 0; k < gap_begin.size(); k++)
+        {
+            if (gap_capacity[k] >= len)
+                break;
+        }
+
+        if (k == gap_begin.size())
+            return false;
+
+        // skip bad and lost clusters at the beginning, the rest is skipped when building targets
+        pos = gap_begin[k];
+        while (_is_cluster_fixed(pos))
+            pos++;
+        file_base_offsets[i] = pos;
+
+        // and move gap beginning behind the file
+        for (j = 0; j < len; pos++)
+        {
+            if (!_is_cluster_fixed(pos))
+                j++;
+        }
+        gap_begin[k] = pos;
+        gap_capacity[k] -= len;
+    }
+
+    return true;
+}
+
+void fat_partition::_compute_file_base_offsets()
+{
+    uint32_t i, tmp;
+
+    file_base_offsets = new uint32_t[(uint32_t)bootrec->root_directory_max_entries_count];
+
+    if (placement_policy == PLACEMENT_POLICY_MINIMAL)
+    {
+        if (_compute_file_base_offsets_minimal())
+            return;
+
+        cout << "Files does not fit into gaps between contiguous files, falling back to packed placement" << endl;
+    }
+
+    // chain length is the resulting size of file block (file size may not match it, when the size is damaged)
+    uint32_t currBase = 0, oldBase = 0;
+    for (i = 0; i < bootrec->root_directory_max_entries_count; i++)
+    {
+        file_base_offsets[i] = currBase;
+        oldBase = currBase;
+        currBase += _chain_length(i);
+
+        // skip bad and lost clusters - move next file_base offsets
+        for (tmp = oldBase; tmp < currBase && tmp < bootrec->cluster_count; tmp++)
+        {
+            if (_is_cluster_fixed(tmp))
+                currBase++;
+        }
+    }
+}
+
+void fat_partition::_print_defrag_stats(uint64_t elapsed_ns)
+{
+    uint32_t i;
+    defrag_thread_stats total;
+    const char* engine = (defrag_engine == DEFRAG_ENGINE_CYCLES) ? "cycles" : "queue";
+
+    memset(&total, 0, sizeof(defrag_thread_stats));
+
+    if (stats_output == STATS_OUTPUT_JSON)
+        cout << "{\"defrag_stats\":{\"engine\":\"" << engine << "\",\"threads\":" << (uint32_t)thread_count << ",\"elapsed_ms\":" << elapsed_ns / 1000000.0 << ",\"per_thread\":[";
+    else
+        cout << "Defragmentation statistics (" << engine << " engine, " << elapsed_ns / 1000000.0 << " ms):" << endl;
+
+    // the last row is sum of all workers
+    for (i = 0; i <= thread_count; i++)
+    {
+        const defrag_thread_stats& st = (i < thread_count) ? defrag_stats[i] : total;
+
+        if (i < thread_count)
+        {
+            total.moves += st.moves;
+            total.clusters += st.clusters;
+            total.retries += st.retries;
+            total.reserve_failures += st.reserve_failures;
+            total.waits += st.waits;
+            total.cycle_breaks += st.cycle_breaks;
+            total.queue_wait_ns += st.queue_wait_ns;
+            total.region_wait_ns += st.region_wait_ns;
+        }
+
+        if (stats_output == STATS_OUTPUT_JSON)
+        {
+            if (i < thread_count)
+                cout << (i > 0 ? "," : "") << "{\"thread\":" << i << ",";
+            else
+                cout << "],\"total\":{";
+
+            cout << "\"moves\":" << st.moves << ",\"clusters\":" << st.clusters << ",\"retries\":" << st.retries
+                 << ",\"reserve_failures\":" << st.reserve_failures << ",\"waits\":" << st.waits << ",\"cycle_breaks\":" << st.cycle_breaks
+                 << ",\"queue_wait_ms\":" << st.queue_wait_ns / 1000000.0 << ",\"region_wait_ms\":" << st.region_wait_ns / 1000000.0 << "}";
+        }
+        else
+        {
+            if (i < thread_count)
+                cout << "  Thread " << i << ": ";
+            else
+                cout << "  Total: ";
+
+            cout << st.clusters << " clusters in " << st.moves << " moves, " << st.retries << " retries, " << st.reserve_failures << " failed reservations, "
+                 << st.waits << " waits, " << st.cycle_breaks << " cycle breaks; waited " << st.queue_wait_ns / 1000000.0 << " ms for queue, "
+                 << st.region_wait_ns / 1000000.0 << " ms for regions" << endl;
+        }
+    }
+
+    if (stats_output == STATS_OUTPUT_JSON)
+        cout << "}}" << endl;
+}
+
+bool fat_partition::defragment()
+{
+    profile_phase phase("defrag");
+    bool result;
+    uint64_t start_time;
+
+    // cycle rotation does not need any free space, queue engine needs one free cluster to break cycles
+    if (defrag_engine == DEFRAG_ENGINE_QUEUE && find_free_cluster_begin() == FAT_UNUSED_NOT_FOUND)
+    {
+        cout << "Not enough free space for defragmentation, please, make sure at least one data cluster is free" << endl;
+        return false;
+    }
+
+    cout << "Defragmenting..." << endl << endl;
+
+    // resumed defragmentation has to keep placement it started with
+    if (!checkpoint_loaded)
+        _compute_file_base_offsets();
+
+    defrag_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(defrag_time_budget);
+
+    // counters are summed over all rounds
+    defrag_stats_memory = new uint8_t[sizeof(defrag_thread_stats) * thread_count + CACHE_LINE_SIZE - 1];
+    defrag_stats = (defrag_thread_stats*)(((uintptr_t)defrag_stats_memory + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+    memset(defrag_stats, 0, sizeof(defrag_thread_stats) * thread_count);
+    start_time = stats_clock();
+
+    // in-place changes are committed in rounds, so the image is consistent after each of them
+    if (cluster_mode == CLUSTER_MODE_DISK)
+        result = _defragment_journaled();
+    else
+        result = _defragment_round(defrag_move_budget);
+
+    if (cluster_io_failed)
+    {
+        cerr << "Cluster contents could not be moved in image file" << endl;
+        result = false;
+    }
+
+    if (stats_output != STATS_OUTPUT_NONE)
+        _print_defrag_stats(stats_clock() - start_time);
+
+    delete[] defrag_stats_memory;
+    defrag_stats_memory = nullptr;
+    defrag_stats = nullptr;
+
+    if (defrag_incomplete)
+        cout << "Defragmentation budget exhausted, " << occupied_clusters_to_work.size() << " clusters remains to be processed" << endl;
+
+    // cleanup; base offsets are kept for checkpoint, when not finished
+    if (!defrag_incomplete)
+    {
+        delete[] file_base_offsets;
+        file_base_offsets = nullptr;
+    }
+    return result;
+}
+
+bool fat_partition::_defragment_round(uint32_t move_limit)
+{
+    bool result;
+
+    defrag_moves_taken = 0;
+    defrag_budget_exhausted = false;
+    move_budget_limit = move_limit;
+
+    // precompute target position of every cluster
+    build_cluster_targets();
+
+    if (defrag_engine == DEFRAG_ENGINE_CYCLES)
+        result = _defragment_cycles();
+    else
+    {
+        result = _defragment_queue();
+
+        // queue engine relinks FAT directly and does not maintain cached extents
+        _recache_chains();
+    }
+
+    delete[] cluster_targets;
+    cluster_targets = nullptr;
+
+    return result;
+}
+
+bool fat_partition::_defragment_journaled()
+{
+    uint32_t limit, taken;
+    uint32_t remaining = defrag_move_budget;
+    uint32_t round_moves = JOURNAL_BATCH_SIZE / bootrec->cluster_size;
+
+    if (round_moves == 0)
+        round_moves = 1;
+
+    while (true)
+    {
+        limit = (defrag_move_budget > 0 && remaining < round_moves) ? remaining : round_moves;
+
+        if (!_defragment_round(limit) || cluster_io_failed)
+            return false;
+
+        // group commit of all moves in this round
+        if (!_commit_changes(image_fd))
+        {
+            cerr << "Failed to commit defragmentation round to image file" << endl;
+            return false;
+        }
+
+        if (!defrag_incomplete)
+            break;
+
+        // stop, when whole budget was used
+        taken = (defrag_moves_taken < limit) ? (uint32_t)defrag_moves_taken : limit;
+        if (defrag_move_budget > 0)
+        {
+            remaining -= taken;
+            if (remaining == 0)
+                break;
+        }
+        if (defrag_time_budget > 0 && std::chrono::steady_clock::now() >= defrag_deadline)
+            break;
+
+        // round, that moved nothing, would be repeated forever
+        if (taken == 0)
+        {
+            cout << "Defragmentation round did not move any cluster, could not proceed" << endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool fat_partition::plan_defragment()
+{
+    profile_phase phase("plan");
+    uint32_t i;
+    size_t j;
+    uint64_t moves = 0, seeks = 0, cycles = 0;
+    uint32_t head = FAT_UNUSED_NOT_FOUND;
+    uint32_t source, dest;
+
+    cout << "Planning defragmentation..." << endl << endl;
+
+    _compute_file_base_offsets();
+    build_cluster_targets();
+
+    if (!_plan_move_chains())
+    {
+        delete[] file_base_offsets;
+        delete[] cluster_targets;
+        return false;
+    }
+
+    // print moves in the same order, as they would be done by single worker;
+    // seek is counted every time the next read or write does not follow previous one
+    cout << "Move plan:" << endl;
+    for (i = 0; i < move_chains.size(); i++)
+    {
+        const defrag_move_chain& chain = move_chains[i];
+
+        if (chain.cycle)
+        {
+            cycles++;
+            cout << "  " << chain.clusters[0] << " -> scratch\n";
+            if (head != chain.clusters[0])
+                seeks++;
+            head = chain.clusters[0] + 1;
+            moves++;
+        }
+
+        for (j = (chain.cycle ? 1 : 0); j < chain.clusters.size(); j++)
+        {
+            source = chain.clusters[j];
+            dest = cluster_targets[source];
+
+            cout << "  " << source << " -> " << dest << "\n";
+            if (head != source)
+                seeks++;
+            if (source + 1 != dest)
+                seeks++;
+            head = dest + 1;
+            moves++;
+        }
+
+        if (chain.cycle)
+        {
+            dest = chain.clusters[chain.clusters.size() - 1];
+            cout << "  scratch -> " << dest << "\n";
+            if (head != dest)
+                seeks++;
+            head = dest + 1;
+            moves++;
+        }
+    }
+
+    cout << endl;
+    cout << "Moves: " << moves << endl;
+    cout << "Bytes: " << moves * bootrec->cluster_size << endl;
+    cout << "Chains: " << move_chains.size() - cycles << endl;
+    cout << "Cycles: " << cycles << endl;
+    cout << "Estimated seeks: " << seeks << endl;
+
+    // cleanup
+    move_chains.clear();
     delete[] file_base_offsets;
+    delete[] cluster_targets;
 
     return true;
 }
@@ -0,0 +1,239 @@
+#include "global.h"
+#include "pseudofat.h"
+#include "fileio.h"
+
+// FNV-1a offset basis
+#define JOURNAL_CHECKSUM_INIT 14695981039346656037ULL
+// FNV-1a prime
+#define JOURNAL_CHECKSUM_PRIME 1099511628211ULL
+
+static uint64_t journal_checksum_update(uint64_t hash, const uint8_t* data, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        hash ^= data[i];
+        hash *= JOURNAL_CHECKSUM_PRIME;
+    }
+
+    return hash;
+}
+
+// writes all records of complete journal to image
+static bool journal_replay(int journal, int image, uint32_t record_count)
+{
+    journal_record record;
+    std::vector<uint8_t> data;
+    uint64_t pos;
+    uint32_t i;
+    bool valid = true;
+
+    for (i = 0, pos = sizeof(journal_header); valid && i < record_count; i++)
+    {
+        valid = file_pread(journal, &record, sizeof(journal_record), pos);
+        if (valid)
+        {
+            data.resize(record.length);
+            valid = file_pread(journal, data.data(), record.length, pos + sizeof(journal_record))
+                 && file_pwrite(image, data.data(), record.length, record.offset);
+        }
+        pos += sizeof(journal_record) + record.length;
+    }
+
+    return valid && file_flush(image);
+}
+
+bool fat_partition::_emit_region(int fd, uint32_t type, int64_t offset, const uint8_t* data, size_t length)
+{
+    journal_record record;
+
+    // regular write to image
+    if (fd != journal_fd)
+        return file_pwrite(fd, data, length, offset);
+
+    // record is appended behind previous ones, header is written at last
+    record.type = type;
+    record.length = (uint32_t)length;
+    record.offset = offset;
+
+    if (!file_pwrite(journal_fd, &record, sizeof(journal_record), sizeof(journal_header) + journal_length)
+        || !file_pwrite(journal_fd, data, length, sizeof(journal_header) + journal_length + sizeof(journal_record)))
+        return false;
+
+    journal_checksum = journal_checksum_update(journal_checksum, (const uint8_t*)&record, sizeof(journal_record));
+    journal_checksum = journal_checksum_update(journal_checksum, data, length);
+    journal_length += sizeof(journal_record) + length;
+    journal_records++;
+
+    return true;
+}
+
+const uint8_t* fat_partition::_dirty_cluster_data(uint32_t index)
+{
+    // in-place defragmentation keeps new contents aside until commit
+    if (cluster_mode == CLUSTER_MODE_DISK)
+        return pending_data.data() + pending_clusters[index];
+
+    return _cluster_data(index);
+}
+
+bool fat_partition::_commit_changes(int fd)
+{
+    journal_header header;
+    std::string filename = image_filename + JOURNAL_SUFFIX;
+
+    // nothing to do
+    if (dirty_fat_pages.count() == 0 && dirty_rootdir.count() == 0 && dirty_clusters.count() == 0)
+        return true;
+
+    if (journal_fd < 0)
+    {
+        journal_fd = file_create_rw(filename.c_str());
+        if (journal_fd < 0)
+        {
+            cerr << "Failed to create journal " << filename << ". Please, check permissions." << endl;
+            return false;
+        }
+    }
+
+    // all changes goes to journal at first, so the interrupted write to image can be finished later
+    journal_length = 0;
+    journal_records = 0;
+    journal_checksum = JOURNAL_CHECKSUM_INIT;
+
+    cout << "Writing changes to journal..." << endl;
+    if (!_write_dirty_regions(journal_fd))
+        return false;
+
+    memset(&header, 0, sizeof(journal_header));
+    memcpy(header.signature, JOURNAL_SIGNATURE, std::min(strlen(JOURNAL_SIGNATURE), (size_t)FAT_SIGNATURE_SIZE));
+    header.record_count = journal_records;
+    header.payload_length = journal_length;
+    header.checksum = journal_checksum;
+
+    // commit point - from now on, changes are finished by recovery if we fail
+    if (!file_pwrite(journal_fd, &header, sizeof(journal_header), 0) || !file_flush(journal_fd))
+        return false;
+
+    // and then the same changes to image itself; untouched pages of private mapping may follow the image,
+    // while it is being overwritten, so mapped clusters are taken from journal instead
+    if (cluster_mode == CLUSTER_MODE_MAPPED)
+    {
+        if (!journal_replay(journal_fd, fd, journal_records))
+            return false;
+    }
+    else if (!_write_dirty_regions(fd) || !file_flush(fd))
+        return false;
+
+    // saved state is the new baseline
+    _reset_dirty();
+    pending_clusters.clear();
+    pending_data.clear();
+
+    return true;
+}
+
+void fat_partition::_close_journal()
+{
+    std::string filename = image_filename + JOURNAL_SUFFIX;
+
+    if (journal_fd < 0)
+        return;
+
+    file_close(journal_fd);
+    journal_fd = -1;
+
+    // everything is in image, journal is not needed anymore
+    remove(filename.c_str());
+}
+
+bool fat_partition::_recover_journal(const char* filename)
+{
+    journal_header header;
+    journal_record record;
+    std::vector<uint8_t> data;
+    uint64_t checksum = JOURNAL_CHECKSUM_INIT;
+    uint64_t pos, end = 0;
+    uint32_t i;
+    int image;
+    bool valid;
+
+    std::string jname = std::string(filename) + JOURNAL_SUFFIX;
+
+    int fd = file_open_ro(jname.c_str());
+    if (fd < 0)
+        return true;
+
+    cout << "Found journal " << jname << ", checking it..." << endl;
+
+    // verify all records before anything is written
+    valid = file_pread(fd, &header, sizeof(journal_header), 0) && strncmp(header.signature, JOURNAL_SIGNATURE, FAT_SIGNATURE_SIZE) == 0
+         && file_size(fd) >= 0 && header.payload_length <= (uint64_t)file_size(fd) - sizeof(journal_header);
+    for (i = 0, pos = sizeof(journal_header); valid && i < header.record_count; i++)
+    {
+        valid = file_pread(fd, &record, sizeof(journal_record), pos);
+
+        // torn journal may contain anything - record has to fit into payload before its data are read
+        if (valid)
+            valid = pos + sizeof(journal_record) + record.length <= sizeof(journal_header) + header.payload_length && record.offset >= 0;
+        if (valid)
+        {
+            data.resize(record.length);
+            valid = file_pread(fd, data.data(), record.length, pos + sizeof(journal_record));
+        }
+        if (valid)
+        {
+            if ((uint64_t)record.offset + record.length > end)
+                end = (uint64_t)record.offset + record.length;
+            checksum = journal_checksum_update(checksum, (const uint8_t*)&record, sizeof(journal_record));
+            checksum = journal_checksum_update(checksum, data.data(), record.length);
+            pos += sizeof(journal_record) + record.length;
+        }
+    }
+    valid = valid && pos == sizeof(journal_header) + header.payload_length && checksum == header.checksum;
+
+    // changes were not committed, so image was not touched by them - roll back by discarding journal
+    if (!valid)
+    {
+        cout << "Journal is incomplete, changes recorded in it are discarded" << endl;
+        file_close(fd);
+        remove(jname.c_str());
+        return true;
+    }
+
+    // committed changes may be written to image only partially - roll forward by writing all of them again
+    image = file_open_rw(filename);
+    if (image < 0)
+    {
+        cerr << "Failed to open file " << filename << " for journal recovery. Please, check permissions." << endl;
+        file_close(fd);
+        return false;
+    }
+
+    // journal is complete, but does not belong to this image - keep it for inspection
+    if (file_size(image) < 0 || end > (uint64_t)file_size(image))
+    {
+        cerr << "Journal " << jname << " contains changes outside of image " << filename << ", leaving both untouched" << endl;
+        file_close(image);
+        file_close(fd);
+        return false;
+    }
+
+    valid = journal_replay(fd, image, header.record_count);
+
+    file_close(image);
+    file_close(fd);
+
+    if (!valid)
+    {
+        cerr << "Failed to write journal records to " << filename << endl;
+        return false;
+    }
+
+    remove(jname.c_str());
+
+    cout << "Recovered " << header.record_count << " journal records" << endl;
+
+    return true;
+}
@@ -1,5 +1,43 @@
 #include "global.h"
 #include "pseudofat.h"
+#include "profiler.h"
+#include "fileio.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+fat_partition::fat_partition()
+{
+    bootrec = nullptr;
+    rootdir = nullptr;
+    fat_tables = nullptr;
+    cluster_arena = nullptr;
+    cluster_slots = nullptr;
+
+    file_base_offsets = nullptr;
+    cluster_targets = nullptr;
+    cluster_predecessors = nullptr;
+    rootdir_extents = nullptr;
+    defrag_stats = nullptr;
+    defrag_stats_memory = nullptr;
+
+    defrag_incomplete = false;
+    checkpoint_loaded = false;
+
+    cluster_mode = CLUSTER_MODE_MEMORY;
+    image_fd = -1;
+    cluster_region_offset = 0;
+    cluster_io_failed = false;
+    image_map = nullptr;
+    image_map_size = 0;
+
+    journal_fd = -1;
+    recoverable_errors = 0;
+    check_owners = nullptr;
+    check_conflicts = nullptr;
+    move_budget_limit = 0;
+}
 
 bool fat_partition::_read_bootrecord(FILE* f)
 {
@@ -36,24 +74,6 @@ bool fat_partition::_create_bootrecord(const char* volume_desc, int32_t fat_type
     return true;
 }
 
-bool fat_partition::_read_fat_tables(FILE* f)
-{
-    int i;
-
-    // read available fat tables
-    fat_tables = new uint32_t*[bootrec->fat_copies];
-    for (i = 0; i < bootrec->fat_copies; i++)
-    {
-        cout << "Reading FAT table " << i << "..." << endl;
-        fat_tables[i] = new uint32_t[bootrec->cluster_count];
-
-        if (fread(fat_tables[i], sizeof(uint32_t), bootrec->cluster_count, f) != bootrec->cluster_count)
-            return false;
-    }
-
-    return true;
-}
-
 bool fat_partition::_create_fat_tables()
 {
     int i;
@@ -99,25 +119,187 @@ bool fat_partition::_read_root_directory(FILE* f)
     return true;
 }
 
-bool fat_partition::_read_clusters(FILE* f)
+bool fat_partition::_allocate_cluster_arena()
 {
     uint32_t i;
+    size_t size = (size_t)real_cluster_count * bootrec->cluster_size;
+
+    if (size == 0)
+        return false;
 
-    // read all data clusters
-    cout << "Reading cluster info..." << endl;
-    clusters = new uint8_t*[real_cluster_count];
+#ifdef __linux__
+    // anonymous mapping is zeroed, and may be backed by huge pages
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return false;
+#ifdef MADV_HUGEPAGE
+    madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    cluster_arena = (uint8_t*)ptr;
+#else
+    cluster_arena = new uint8_t[size];
+    memset(cluster_arena, 0, size);
+#endif
+
+    // every cluster starts in its own slot
+    cluster_slots = new uint32_t[real_cluster_count];
     for (i = 0; i < real_cluster_count; i++)
+        cluster_slots[i] = i;
+
+    return true;
+}
+
+uint8_t* fat_partition::_cluster_data(uint32_t index)
+{
+    return cluster_arena + (size_t)cluster_slots[index] * bootrec->cluster_size;
+}
+
+bool fat_partition::_check_image_size(FILE* f)
+{
+    int64_t end;
+    uint64_t size;
+
+    if (bootrec->fat_copies < 1 || bootrec->root_directory_max_entries_count < 0)
+        return false;
+
+    size = sizeof(boot_record)
+         + (uint64_t)sizeof(uint32_t) * bootrec->cluster_count * bootrec->fat_copies
+         + (uint64_t)sizeof(root_directory) * bootrec->root_directory_max_entries_count
+         + (uint64_t)real_cluster_count * bootrec->cluster_size;
+
+    end = file_stream_size(f);
+
+    return end >= 0 && (uint64_t)end >= size;
+}
+
+void fat_partition::_add_read_jobs(uint8_t* buffer, uint64_t length, int64_t offset)
+{
+    image_read_job job;
+
+    // smaller chunks spreads single big region over all threads
+    while (length > 0)
+    {
+        job.buffer = buffer;
+        job.length = (size_t)((length > LOAD_CHUNK_SIZE) ? LOAD_CHUNK_SIZE : length);
+        job.offset = offset;
+        read_jobs.push_back(job);
+
+        buffer += job.length;
+        offset += job.length;
+        length -= job.length;
+    }
+}
+
+void fat_partition::load_thread_process(uint32_t threadid)
+{
+    uint32_t i;
+
+    while (!read_failed)
+    {
+        i = read_job_next++;
+        if (i >= read_jobs.size())
+            break;
+
+        if (!file_pread(image_fd, read_jobs[i].buffer, read_jobs[i].length, read_jobs[i].offset))
+        {
+            cerr << "Thread " << threadid << ": failed to read " << read_jobs[i].length << " bytes at offset " << read_jobs[i].offset << endl;
+            read_failed = true;
+        }
+    }
+}
+
+void load_thread_fnc(fat_partition* partition, uint32_t thread_id)
+{
+    partition->load_thread_process(thread_id);
+}
+
+bool fat_partition::_read_image_parallel(FILE* f, const char* filename, bool with_clusters)
+{
+    int32_t i;
+    uint32_t j;
+    uint64_t total = 0;
+    int64_t offset = sizeof(boot_record);
+    int64_t rootdir_offset;
+    bool rootdir_ok;
+    double elapsed;
+
+    image_fd = file_open_ro(filename);
+    if (image_fd < 0)
+        return false;
+
+    // region offsets are given by bootrecord, so all regions can be read at once
+    fat_tables = new uint32_t*[bootrec->fat_copies];
+    for (i = 0; i < bootrec->fat_copies; i++)
+    {
+        cout << "Reading FAT table " << i << "..." << endl;
+        fat_tables[i] = new uint32_t[bootrec->cluster_count];
+
+        _add_read_jobs((uint8_t*)fat_tables[i], (uint64_t)sizeof(uint32_t) * bootrec->cluster_count, offset);
+        offset += (int64_t)sizeof(uint32_t) * bootrec->cluster_count;
+    }
+
+    rootdir_offset = offset;
+    offset += (int64_t)sizeof(root_directory) * bootrec->root_directory_max_entries_count;
+    cluster_region_offset = offset;
+
+    if (with_clusters)
     {
-        clusters[i] = new uint8_t[bootrec->cluster_size];
-        if (fread(clusters[i], sizeof(uint8_t), bootrec->cluster_size, f) != bootrec->cluster_size)
+        cout << "Reading cluster info..." << endl;
+        if (!_allocate_cluster_arena())
+        {
+            file_close(image_fd);
+            image_fd = -1;
             return false;
+        }
+
+        _add_read_jobs(cluster_arena, (uint64_t)real_cluster_count * bootrec->cluster_size, offset);
+    }
+
+    read_job_next = 0;
+    read_failed = false;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // create loader threads
+    std::thread** workers = new std::thread*[thread_count];
+    for (j = 0; j < thread_count; j++)
+        workers[j] = new std::thread(load_thread_fnc, this, j);
+
+    // root directory is small (and may be printed), so read it in the meantime
+    rootdir_ok = file_stream_seek(f, (int64_t)rootdir_offset) && _read_root_directory(f);
+
+    for (j = 0; j < thread_count; j++)
+    {
+        workers[j]->join();
+        delete workers[j];
+    }
+    delete[] workers;
+
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (j = 0; j < read_jobs.size(); j++)
+        total += read_jobs[j].length;
+    read_jobs.clear();
+
+    file_close(image_fd);
+    image_fd = -1;
 
-        if (verbose_output == 2)
+    if (read_failed || !rootdir_ok)
+        return false;
+
+    cout << "Read " << ((double)total / (1024.0 * 1024.0)) << " MB using " << (uint32_t)thread_count << " threads in " << (elapsed * 1000.0) << " ms";
+    if (elapsed > 0)
+        cout << " (" << round((double)total / (1024.0 * 1024.0) / elapsed) << " MB/s)";
+    cout << endl;
+
+    if (with_clusters && verbose_output == 2)
+    {
+        for (j = 0; j < real_cluster_count; j++)
         {
-            if (clusters[i][0] != '\0')
+            if (_cluster_data(j)[0] != '\0')
             {
-                cout << "Cluster " << i << " contents: " << endl;
-                cout << clusters[i] << endl;
+                cout << "Cluster " << j << " contents: " << endl;
+                cout << _cluster_data(j) << endl;
                 cout << endl;
             }
         }
@@ -126,24 +308,113 @@ bool fat_partition::_read_clusters(FILE* f)
     return true;
 }
 
-bool fat_partition::_create_clusters()
+bool fat_partition::_open_clusters(const char* filename)
 {
-    uint32_t i = 0;
+    // clusters are not read, image size was already checked
+    image_fd = file_open_rw(filename);
+    if (image_fd < 0)
+    {
+        cerr << "Failed to open file " << filename << " for in-place access. Please, check permissions." << endl;
+        return false;
+    }
 
-    cout << "Creating cluster array..." << endl;
-    clusters = new uint8_t*[real_cluster_count];
-    for (i = 0; i < real_cluster_count; i++)
+    cluster_mode = CLUSTER_MODE_DISK;
+
+    return true;
+}
+
+bool fat_partition::_map_image(uint8_t* image, size_t size, int mode)
+{
+    int32_t i;
+    uint32_t j;
+    uint64_t offset = sizeof(boot_record);
+
+    if (size < offset)
+        return false;
+
+    image_map = image;
+    image_map_size = size;
+
+    bootrec = (boot_record*)image;
+    real_cluster_count = bootrec->cluster_count - bootrec->reserved_cluster_count;
+
+    if (bootrec->fat_copies < 1 || bootrec->root_directory_max_entries_count < 0)
+        return false;
+
+    // FAT tables follows bootrecord, and they are always aligned properly
+    fat_tables = new uint32_t*[bootrec->fat_copies];
+    for (i = 0; i < bootrec->fat_copies; i++)
     {
-        clusters[i] = new uint8_t[bootrec->cluster_size];
-        memset(clusters[i], 0, sizeof(uint8_t) * bootrec->cluster_size);
+        fat_tables[i] = (uint32_t*)(image + offset);
+        offset += (uint64_t)sizeof(uint32_t) * bootrec->cluster_count;
     }
 
+    if (offset + sizeof(root_directory) * (uint64_t)bootrec->root_directory_max_entries_count + (uint64_t)real_cluster_count * bootrec->cluster_size > size)
+        return false;
+
+    // root directory may start at unaligned position (odd count of FAT entries), then it has to be copied
+    if (offset % sizeof(int64_t) == 0)
+        rootdir = (root_directory*)(image + offset);
+    else
+    {
+        rootdir = new root_directory[(uint32_t)bootrec->root_directory_max_entries_count];
+        memcpy(rootdir, image + offset, sizeof(root_directory) * (size_t)bootrec->root_directory_max_entries_count);
+    }
+    offset += sizeof(root_directory) * (uint64_t)bootrec->root_directory_max_entries_count;
+
+    // clusters are used right from the mapping, pages are read when touched
+    cluster_region_offset = (int64_t)offset;
+    cluster_arena = image + offset;
+    cluster_slots = new uint32_t[real_cluster_count];
+    for (j = 0; j < real_cluster_count; j++)
+        cluster_slots[j] = j;
+
+    cluster_mode = mode;
+
     return true;
 }
 
-fat_partition* fat_partition::load_from_file(const char* filename)
+bool fat_partition::_create_clusters()
+{
+    cout << "Creating cluster array..." << endl;
+
+    return _allocate_cluster_arena();
+}
+
+fat_partition* fat_partition::load_from_file(const char* filename, int cluster_mode)
 {
+    profile_phase phase("load");
     fat_partition* partition = new fat_partition;
+    uint8_t* image;
+    size_t size;
+
+    // image has to be consistent before anything is read from it
+    if (!_recover_journal(filename))
+        return nullptr;
+
+    if (cluster_mode == CLUSTER_MODE_MAPPED)
+    {
+        image = file_map(filename, &size);
+        if (image)
+        {
+            cout << "Mapping filesystem..." << endl;
+
+            if (!partition->_map_image(image, size, cluster_mode))
+            {
+                cerr << "Invalid file supplied - file does not contain all structures specified in bootrecord" << endl;
+                return nullptr;
+            }
+
+            partition->image_filename = filename;
+            partition->_reset_dirty();
+
+            return partition;
+        }
+
+        // mapping is not available, so read image the usual way
+        cout << "Could not map file " << filename << ", falling back to reading" << endl;
+        cluster_mode = CLUSTER_MODE_MEMORY;
+    }
 
     FILE* f = fopen(filename, "rb");
 
@@ -161,26 +432,32 @@ fat_partition* fat_partition::load_from_file(const char* filename)
         return nullptr;
     }
 
-    if (!partition->_read_fat_tables(f))
+    if (!partition->_check_image_size(f))
     {
-        cerr << "Invalid file supplied - file does not contain FAT tables specified by count in bootrecord" << endl;
+        cerr << "Invalid file supplied - file does not contain FAT tables, root directory entries and clusters specified in bootrecord" << endl;
         return nullptr;
     }
 
-    if (!partition->_read_root_directory(f))
+    // cluster contents are read only when they are kept in memory
+    if (!partition->_read_image_parallel(f, filename, cluster_mode == CLUSTER_MODE_MEMORY))
     {
-        cerr << "Invalid file supplied - file does not contain specified root directory entries" << endl;
+        cerr << "Failed to read filesystem from file " << filename << endl;
         return nullptr;
     }
 
-    if (!partition->_read_clusters(f))
+    if (cluster_mode == CLUSTER_MODE_NONE)
+        partition->cluster_mode = CLUSTER_MODE_NONE;
+    else if (cluster_mode == CLUSTER_MODE_DISK)
     {
-        cerr << "Invalid file supplied - file does not contain specified count of clusters" << endl;
-        return nullptr;
+        if (!partition->_open_clusters(filename))
+            return nullptr;
     }
 
     fclose(f);
 
+    partition->image_filename = filename;
+    partition->_reset_dirty();
+
     return partition;
 }
 
@@ -208,5 +485,7 @@ fat_partition* fat_partition::create(const char* volume_desc, int32_t fat_type,
         return nullptr;
     }
 
+    partition->_reset_dirty();
+
     return partition;
 }
@@ -1,5 +1,7 @@
 #include "global.h"
 #include "pseudofat.h"
+#include "profiler.h"
+#include "fileio.h"
 
 #include <string>
 
@@ -43,87 +45,245 @@ bool fat_partition::_write_root_directory(FILE* f)
 
 bool fat_partition::_write_clusters(FILE* f)
 {
-    uint32_t i;
+    uint32_t i, count;
 
     cout << "Writing cluster info..." << endl;
-    for (i = 0; i < real_cluster_count; i++)
+    for (i = 0; i < real_cluster_count; i += count)
     {
-        if (fwrite(clusters[i], sizeof(uint8_t), bootrec->cluster_size, f) != bootrec->cluster_size)
+        // clusters with consecutive slots are written at once
+        for (count = 1; i + count < real_cluster_count && cluster_slots[i + count] == cluster_slots[i] + count; count++)
+            ;
+
+        if (fwrite(_cluster_data(i), bootrec->cluster_size, count, f) != count)
             return false;
     }
 
     return true;
 }
 
-bool fat_partition::save_to_file(const char* filename)
+void fat_partition::_reset_dirty()
 {
-    FILE* f = fopen(filename, "wb");
+    dirty_fat_pages.resize(bootrec->cluster_count / FAT_DIRTY_PAGE_ENTRIES + 1);
+    dirty_rootdir.resize((uint32_t)bootrec->root_directory_max_entries_count);
+    dirty_clusters.resize(real_cluster_count);
+}
 
-    if (!f)
+void fat_partition::_mark_fat_dirty(uint32_t index)
+{
+    if (index < bootrec->cluster_count)
+        dirty_fat_pages.set(index / FAT_DIRTY_PAGE_ENTRIES);
+}
+
+void fat_partition::_mark_rootdir_dirty(uint32_t index)
+{
+    dirty_rootdir.set(index);
+}
+
+void fat_partition::_mark_cluster_dirty(uint32_t index)
+{
+    if (index < real_cluster_count)
+        dirty_clusters.set(index);
+}
+
+bool fat_partition::_write_dirty_regions(int fd)
+{
+    uint32_t first, last, begin, end, i, count;
+    int32_t j;
+    uint64_t written = 0, writes = 0;
+    int64_t fat_offset = sizeof(boot_record);
+    int64_t rootdir_offset = fat_offset + (int64_t)sizeof(uint32_t) * bootrec->cluster_count * bootrec->fat_copies;
+    uint32_t fat_pages = bootrec->cluster_count / FAT_DIRTY_PAGE_ENTRIES + 1;
+    uint32_t rootdir_count = (uint32_t)bootrec->root_directory_max_entries_count;
+
+    // bootrecord never changes, so start with runs of dirty FAT pages, written to every FAT table
+    for (first = dirty_fat_pages.find_first(); first != BITMAP_NOT_FOUND; first = dirty_fat_pages.find_first(last))
     {
-        cerr << "Failed to open file " << filename << " for writing. Please, check permissions." << endl;
-        return false;
+        for (last = first + 1; last < fat_pages && dirty_fat_pages.test(last); last++)
+            ;
+
+        begin = first * FAT_DIRTY_PAGE_ENTRIES;
+        end = (last * FAT_DIRTY_PAGE_ENTRIES < bootrec->cluster_count) ? last * FAT_DIRTY_PAGE_ENTRIES : bootrec->cluster_count;
+
+        for (j = 0; j < bootrec->fat_copies; j++)
+        {
+            if (!_emit_region(fd, JOURNAL_RECORD_FAT, fat_offset + (int64_t)sizeof(uint32_t) * ((uint64_t)j * bootrec->cluster_count + begin), (const uint8_t*)(fat_tables[j] + begin), sizeof(uint32_t) * (end - begin)))
+                return false;
+
+            written += sizeof(uint32_t) * (end - begin);
+            writes++;
+        }
     }
 
-    if (!_write_bootrecord(f))
+    for (first = dirty_rootdir.find_first(); first != BITMAP_NOT_FOUND; first = dirty_rootdir.find_first(last))
     {
-        cerr << "Failed to write bootrecord to file" << endl;
-        return false;
+        for (last = first + 1; last < rootdir_count && dirty_rootdir.test(last); last++)
+            ;
+
+        if (!_emit_region(fd, JOURNAL_RECORD_ROOTDIR, rootdir_offset + (int64_t)sizeof(root_directory) * first, (const uint8_t*)&rootdir[first], sizeof(root_directory) * (last - first)))
+            return false;
+
+        written += sizeof(root_directory) * (last - first);
+        writes++;
     }
 
-    if (!_write_fat_tables(f))
+    // runs of dirty clusters are gathered from their slots to one buffer
+    count = SAVE_CHUNK_SIZE / bootrec->cluster_size;
+    if (count == 0)
+        count = 1;
+    std::vector<uint8_t> buffer((size_t)count * bootrec->cluster_size);
+
+    for (first = dirty_clusters.find_first(); first != BITMAP_NOT_FOUND; first = dirty_clusters.find_first(last))
     {
-        cerr << "Failed to write FAT tables to file" << endl;
+        for (last = first + 1; last < real_cluster_count && last - first < count && dirty_clusters.test(last); last++)
+            ;
+
+        for (i = first; i < last; i++)
+            memcpy(buffer.data() + (size_t)(i - first) * bootrec->cluster_size, _dirty_cluster_data(i), bootrec->cluster_size);
+
+        if (!_emit_region(fd, JOURNAL_RECORD_CLUSTERS, cluster_region_offset + (int64_t)first * bootrec->cluster_size, buffer.data(), (size_t)(last - first) * bootrec->cluster_size))
+            return false;
+
+        written += (uint64_t)(last - first) * bootrec->cluster_size;
+        writes++;
+    }
+
+    if (fd == journal_fd)
+        cout << "Journaled " << written << " bytes in " << journal_records << " records" << endl;
+    else
+        cout << "Written " << written << " bytes in " << writes << " writes" << endl;
+
+    return true;
+}
+
+bool fat_partition::_save_in_place()
+{
+    // moved clusters are committed together with metadata
+    if (!_commit_changes(image_fd))
         return false;
+
+    _close_journal();
+
+    return true;
+}
+
+bool fat_partition::save_to_file(const char* filename)
+{
+    profile_phase phase("save");
+
+    // in-place image is always saved to file it was loaded from
+    if (cluster_mode == CLUSTER_MODE_DISK)
+    {
+        if (!_save_in_place())
+        {
+            cerr << "Failed to write metadata back to image file" << endl;
+            return false;
+        }
+
+        return true;
     }
 
-    if (!_write_root_directory(f))
+    // image loaded (or mapped) into memory and saved back to the same file is only updated
+    if ((cluster_mode == CLUSTER_MODE_MEMORY || cluster_mode == CLUSTER_MODE_MAPPED) && !image_filename.empty() && image_filename == filename)
     {
-        cerr << "Failed to write root directory entries to file" << endl;
-        return false;
+        int fd = file_open_rw(filename);
+        bool res = (fd >= 0) && _commit_changes(fd);
+
+        if (fd >= 0)
+            file_close(fd);
+        if (res)
+            _close_journal();
+
+        if (!res)
+        {
+            cerr << "Failed to write changes back to image file " << filename << endl;
+            return false;
+        }
+
+        return true;
     }
 
-    if (!_write_clusters(f))
+    // whole image is written to temporary file, so the interrupted save never leaves truncated image behind
+    std::string tmpname = std::string(filename) + ".tmp";
+    FILE* f = fopen(tmpname.c_str(), "wb");
+    bool res = false;
+
+    if (!f)
     {
-        cerr << "Failed to write cluster info to file" << endl;
+        cerr << "Failed to open file " << tmpname << " for writing. Please, check permissions." << endl;
         return false;
     }
 
+    if (!_write_bootrecord(f))
+        cerr << "Failed to write bootrecord to file" << endl;
+    else if (!_write_fat_tables(f))
+        cerr << "Failed to write FAT tables to file" << endl;
+    else if (!_write_root_directory(f))
+        cerr << "Failed to write root directory entries to file" << endl;
+    else if (!_write_clusters(f))
+        cerr << "Failed to write cluster info to file" << endl;
+    else if (fflush(f) != 0 || !file_flush(fileno(f)))
+        cerr << "Failed to flush image file" << endl;
+    else
+        res = true;
+
     fclose(f);
 
-    return true;
+    // replace original file only by complete image
+    if (res && !file_replace(tmpname.c_str(), filename))
+    {
+        cerr << "Failed to replace file " << filename << " by saved image" << endl;
+        res = false;
+    }
+
+    if (!res)
+        remove(tmpname.c_str());
+
+    return res;
 }
 
-void fat_partition::_set_fat_entry(uint32_t index, uint32_t value)
+bool fat_partition::_set_fat_entry(uint32_t index, uint32_t value)
 {
     int32_t i;
 
+    if (index >= bootrec->cluster_count)
+        return false;
+
     for (i = 0; i < bootrec->fat_copies; i++)
         fat_tables[i][index] = (value == FAT_FILE_END && i == 1) ? 65535 : value;
+
+    _mark_fat_dirty(index);
+
+    if (index < real_cluster_count)
+    {
+        if (value == FAT_UNUSED)
+            free_bitmap.set(index);
+        else
+            free_bitmap.clear(index);
+    }
+
+    return true;
 }
 
 void fat_partition::_set_cluster_content(uint32_t index, const char* content)
 {
-    strncpy((char*)clusters[index], content, bootrec->cluster_size);
+    // cluster slots exist only for real clusters
+    if (index >= real_cluster_count)
+        return;
+
+    uint8_t* data = _cluster_data(index);
+
+    _mark_cluster_dirty(index);
 
-    clusters[index][bootrec->cluster_size - 1] = '\0';
+    strncpy((char*)data, content, bootrec->cluster_size);
+
+    data[bootrec->cluster_size - 1] = '\0';
 }
 
 uint32_t fat_partition::_find_nth_free_cluster(uint32_t n)
 {
-    uint32_t i;
-
-    for (i = 0; i < real_cluster_count; i++)
-    {
-        if (fat_tables[0][i] == FAT_UNUSED)
-        {
-            n--;
-            if (n == 1)
-                return i;
-        }
-    }
+    n = free_bitmap.select(n);
 
-    return FAT_UNUSED_NOT_FOUND;
+    return (n == BITMAP_NOT_FOUND) ? FAT_UNUSED_NOT_FOUND : n;
 }
 
 void fat_partition::write_randomized_entry(int32_t break_length_by)
@@ -131,6 +291,10 @@ void fat_partition::write_randomized_entry(int32_t break_length_by)
     uint32_t i, prev, tmp;
     uint32_t nind = (uint32_t)bootrec->root_directory_max_entries_count;
 
+    // only real clusters may be picked, reserved ones are counted as free too
+    if (free_bitmap.count() == 0)
+        return;
+
     root_directory* nrdir = new root_directory[nind + 1];
     memcpy(nrdir, rootdir, sizeof(root_directory)*((uint32_t)bootrec->root_directory_max_entries_count));
 
@@ -153,21 +317,19 @@ void fat_partition::write_randomized_entry(int32_t break_length_by)
 
     nrdir[nind].file_type = 1;
 
-    uint32_t clcnt = rand() % (free_clusters_count - 5);
-    nrdir[nind].first_cluster = _find_nth_free_cluster(clcnt);
+    nrdir[nind].first_cluster = _find_nth_free_cluster(rand() % free_bitmap.count());
     _set_fat_entry(nrdir[nind].first_cluster, FAT_FILE_END);
     free_clusters_count--;
 
     _set_cluster_content(nrdir[nind].first_cluster, "obsah zacatku souboru");
 
-    uint32_t cluster_count = (uint32_t)(nrdir[nind].file_size / bootrec->cluster_size) + break_length_by; // +1-1 (starting cluster is already written)
+    uint32_t cluster_count = _size_to_clusters(nrdir[nind].file_size) - 1 + break_length_by; // starting cluster is already written
 
     prev = nrdir[nind].first_cluster;
 
-    for (i = 0; i < cluster_count; i++)
+    for (i = 0; i < cluster_count && free_bitmap.count() > 0; i++)
     {
-        clcnt = rand() % (free_clusters_count - 1);
-        tmp = _find_nth_free_cluster(clcnt);
+        tmp = _find_nth_free_cluster(rand() % free_bitmap.count());
         free_clusters_count--;
 
         _set_fat_entry(prev, tmp);
@@ -184,7 +346,7 @@ int fat_partition::write_source_file(FILE* source, const char* filename, uint32_
     uint32_t prev, tmp;
     uint32_t nind = (uint32_t)bootrec->root_directory_max_entries_count;
 
-    if (free_clusters_count == 0)
+    if (free_clusters_count == 0 || (randomize && free_bitmap.count() == 0) || (!randomize && dest >= real_cluster_count))
         return 3;
 
     // seek to file start
@@ -207,7 +369,7 @@ int fat_partition::write_source_file(FILE* source, const char* filename, uint32_
 
     nrdir[nind].file_type = 1;
 
-    nrdir[nind].first_cluster = randomize ? _find_nth_free_cluster(rand() % (free_clusters_count - 5)) : dest;
+    nrdir[nind].first_cluster = randomize ? _find_nth_free_cluster(rand() % free_bitmap.count()) : dest;
 
     _set_fat_entry(nrdir[nind].first_cluster, endfile_rec);
     free_clusters_count--;
@@ -230,11 +392,18 @@ int fat_partition::write_source_file(FILE* source, const char* filename, uint32_
 
     while ((bytes_read = fread(write_buffer, 1, bootrec->cluster_size, source)) > 0)
     {
+        if (randomize && free_bitmap.count() == 0)
+            return 3;
+
         do
         {
-            tmp = randomize ? _find_nth_free_cluster(rand() % (free_clusters_count - 1)) : tmp + 1;
+            tmp = randomize ? _find_nth_free_cluster(rand() % free_bitmap.count()) : tmp + 1;
         }
-        while (fat_tables[0][tmp] != FAT_UNUSED);
+        while (tmp < real_cluster_count && fat_tables[0][tmp] != FAT_UNUSED);
+
+        // there's no free cluster behind the previous one
+        if (tmp >= real_cluster_count)
+            return 3;
 
         free_clusters_count--;
 